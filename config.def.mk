@@ -1,5 +1,7 @@
 PREFIX?=/usr/local
 BINDIR?=${PREFIX}/bin
+LIBDIR?=${PREFIX}/lib
+INCLUDEDIR?=${PREFIX}/include
 DESTDIR?=
 
 CC?=cc
@@ -11,6 +13,13 @@ LEXFLAGS=-8 -X
 CFLAGS+=-Wall -Wextra -Wmissing-prototypes -Wredundant-decls
 CFLAGS+=-Iinclude
 
-NEVM_LIBS?=-lcurses -lm
+# Dispatch operations using GCC's labels as values, instead of a switch. This
+# needs GCC's -fno-crossjumping, or the jumps get merged back together.
+# Whether it is faster depends on the machine's branch predictor.
+#CFLAGS+=-DNEVM_THREADED -fno-crossjumping
+
+LIBNEVM_LIBS?=-lm -lpthread
+NEVM_LIBS?=-lcurses -lm -lpthread
+NEVM_BATCH_LIBS?=-lm -lpthread
 NEASM_LIBS?=-ll
 TESTLIBS?=
@@ -0,0 +1,225 @@
+/****************************************************************************
+ * nevm.h the noneleatic virtual machine, as a library                      *
+ *                                                                          *
+ * Each machine is an instance of its own, with its own memory, decode      *
+ * cache, compiled code and statistics, so that any number of them may be   *
+ * run at once, each on its own thread, or in turns on one thread. Nothing  *
+ * here touches a terminal; the screen is just a region of the machine's    *
+ * memory, which the caller may draw as it likes when told that a frame is  *
+ * due. Link with -lnevm -lm -lpthread.                                     *
+ *                                                                          *
+ * Functions which can fail return -1, leaving a description of what went   *
+ * wrong in nevm_error(). A machine which failed while running is left as   *
+ * it was at the failure, and shouldn't be run again.                       *
+ ****************************************************************************/
+#ifndef NEVM_H
+#define NEVM_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+/* only what's declared here is exported from the shared library */
+#pragma GCC visibility push(default)
+
+#define SCREEN_ROWS 25
+#define SCREEN_COLS 80
+#define SCREEN_START 0xF000
+#define SCREEN_LEN (SCREEN_ROWS * SCREEN_COLS)
+#define SCREEN_END (SCREEN_START + SCREEN_LEN)
+#define SCREEN_ALL_ROWS ((UINT32_C(1) << SCREEN_ROWS) - 1)
+
+/* The layouts of the built in devices, as offsets into them. Each word is a
+ * uint32_t. */
+#define NEVM_CLOCK_SECONDS 0 /* since the clock was added */
+#define NEVM_CLOCK_NANOSECONDS 4
+#define NEVM_CLOCK_LEN 8
+
+#define NEVM_INPUT_PUT 0 /* bytes put in the buffer, by the host */
+#define NEVM_INPUT_TAKEN 4 /* bytes taken from it, by the machine */
+#define NEVM_INPUT_END 8 /* set to 1 by the host when the input ends */
+#define NEVM_INPUT_HEADER 12 /* followed by the buffer, used as a ring */
+
+#define NEVM_OUTPUT_PUT 0 /* bytes put in the buffer, by the machine */
+#define NEVM_OUTPUT_SENT 4 /* bytes sent from it, by the host */
+#define NEVM_OUTPUT_HEADER 8 /* followed by the buffer, used as a ring */
+
+#define NEVM_DISK_COMMAND 0 /* set by the machine, cleared by the host */
+#define NEVM_DISK_NUMBER 4 /* of the block to read or write */
+#define NEVM_DISK_STATUS 8 /* 0, or nonzero if the command failed */
+#define NEVM_DISK_HEADER 12 /* followed by the block */
+#define NEVM_DISK_BLOCK 512
+#define NEVM_DISK_LEN (NEVM_DISK_HEADER + NEVM_DISK_BLOCK)
+#define NEVM_DISK_READ 1
+#define NEVM_DISK_WRITE 2
+
+typedef struct nevm nevm;
+
+typedef void (*nevm_frame_fn)(nevm *vm, void *arg);
+
+/* Service a device of len bytes at addr, which the machine has written to
+ * since it was last serviced if written is true. */
+typedef void (*nevm_device_fn)(nevm *vm, uint32_t addr, uint32_t len,
+			       bool written, void *arg);
+
+/* how a machine runs */
+typedef struct {
+	uint32_t brk_max; /* highest address memory may grow to */
+	struct timespec delay; /* between operations */
+	struct timespec frame; /* between frames */
+	uint32_t poll; /* operations between polls for frames and devices */
+	bool jit; /* compile to native code */
+	bool guard; /* leave range checks to guard pages, catching SIGSEGV
+		     * until the machine is freed */
+	bool profile; /* count and time each slot */
+	bool trace; /* record the run with trace.h */
+	nevm_frame_fn frame_fn; /* called when a frame is due, and at halt */
+	void *frame_arg;
+} nevm_config;
+
+/* why nevm_run() returned */
+typedef enum {
+	NEVM_FAILED = -1, /* see nevm_error() */
+	NEVM_HALTED, /* the machine ran a halt operation */
+	NEVM_PAUSED /* the machine ran as many operations as it was allowed */
+} nevm_stop;
+
+/* counts kept as the machine runs */
+typedef struct {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long invalidations;
+	unsigned long jit_ops;
+	unsigned long jit_blocks;
+	unsigned long jit_discarded;
+	unsigned long fused;
+	struct timespec start;
+	struct timespec end;
+} nevm_stats;
+
+/* Fill in the defaults: a limit of 0xFFFF, no delay, 30 frames a second,
+ * polls every 4096 operations, and native code where supported. */
+void nevm_config_default(nevm_config *config);
+
+/* Make a machine with empty memory. Returns NULL if there isn't the memory
+ * for one. */
+nevm *nevm_new(const nevm_config *config);
+
+/* Free the machine and all of its memory. */
+void nevm_free(nevm *vm);
+
+/* The description of the last failure, ending with a newline. */
+const char *nevm_error(const nevm *vm);
+
+/* Restore the machine from a snapshot written by nevm_write_snapshot(). The
+ * memory is mapped from the file, privately, as it is touched. Must come
+ * before any files are loaded. */
+int nevm_restore_snapshot(nevm *vm, const char *filename);
+
+/* Load a file, or stdin for "-", into memory at *cursor, moving *cursor to
+ * the end of it. */
+int nevm_load_file(nevm *vm, uint32_t *cursor, const char *filename);
+
+/* Devices are ranges of memory which the host looks after. The machine's
+ * writes to them are noted as they happen, and each device is serviced in
+ * a batch whenever the machine polls, and when it stops. Devices may not
+ * overlap each other, and are best put near the screen, since writes near
+ * them take longer to look at. */
+
+/* Add a device of the host's own, at len bytes at addr, which fn services.
+ * fn may change its memory with nevm_write(). */
+int nevm_add_device(nevm *vm, uint32_t addr, uint32_t len,
+		    nevm_device_fn fn, void *arg);
+
+/* Add a clock at addr, which gives the time since it was added. */
+int nevm_add_clock(nevm *vm, uint32_t addr);
+
+/* Add an input stream of len bytes at addr, reading from fd as the machine
+ * takes what has been read, without ever waiting for input. */
+int nevm_add_input(nevm *vm, uint32_t addr, uint32_t len, int fd);
+
+/* Add an output stream of len bytes at addr, writing to fd whatever the
+ * machine puts in it. */
+int nevm_add_output(nevm *vm, uint32_t addr, uint32_t len, int fd);
+
+/* Add an output stream as above, but writing into f's buffer, so that
+ * small pieces of output cost no more than large ones. The caller flushes
+ * f, and checks it for errors. */
+int nevm_add_output_file(nevm *vm, uint32_t addr, uint32_t len, FILE *f);
+
+/* Add a block device at addr, which reads and writes fd a block at a
+ * time. */
+int nevm_add_disk(nevm *vm, uint32_t addr, int fd);
+
+/* Copy len bytes from buf into memory at addr, growing memory to hold them
+ * as loading does. Anything cached or compiled from the memory written is
+ * thrown away. This mustn't write the IP from a frame callback, since the
+ * running machine wouldn't see it. */
+int nevm_write(nevm *vm, uint32_t addr, const void *buf, uint32_t len);
+
+/* Copy len bytes from memory at addr into buf. Fails if they aren't all
+ * below the break. */
+int nevm_read(nevm *vm, uint32_t addr, void *buf, uint32_t len);
+
+/* Run the machine until it halts, or, if max_steps isn't 0, until it has
+ * run max_steps operations, so that nevm_run(vm, 1) steps through one
+ * operation at a time. A machine which paused or halted may be run again,
+ * carrying on where it left off. */
+nevm_stop nevm_run(nevm *vm, uint64_t max_steps);
+
+/* The number of operations the machine has run. */
+uint64_t nevm_steps(const nevm *vm);
+
+/* Write a snapshot of the machine to filename. */
+int nevm_write_snapshot(nevm *vm, const char *filename);
+
+/* Write the profile of the run, busiest slots first. */
+int nevm_write_profile(nevm *vm, FILE *out);
+
+/* Print statistics about the run. */
+void nevm_print_stats(nevm *vm, FILE *out);
+
+/* Count the pages of memory the machine has touched: those still shared
+ * with the files they were loaded from, and with any other machine which
+ * loaded the same files, and those the machine has written to or filled
+ * itself, which are its own. */
+int nevm_count_pages(nevm *vm, size_t *shared, size_t *owned);
+
+/* The base of the machine's memory, which is valid up to nevm_brk(). This
+ * is for reading; writing through it skips what nevm_write() does. */
+char *nevm_mem(nevm *vm);
+
+uint32_t nevm_brk(const nevm *vm);
+
+/* The screen rows written since the last call, one bit per row. */
+uint32_t nevm_take_dirty(nevm *vm);
+
+const nevm_stats *nevm_get_stats(const nevm *vm);
+
+/* Print the SCREEN_LEN bytes of the screen at screen, up to the last row
+ * which isn't blank. */
+void nevm_print_screen(const char *screen, FILE *out);
+
+/* Whether op is an operation, and type an argument type. */
+bool nevm_is_op(char op);
+bool nevm_is_arg_type(char type);
+
+/* Load the map written by neasm -m for the image of len bytes loaded at
+ * base. Maps are shared by every machine, and used to describe addresses in
+ * errors and profiles. Returns -1 and sets errno if the map can't be read,
+ * or to EINVAL if it isn't a valid map. */
+int nevm_load_map(const char *filename, uint32_t base, uint32_t len);
+
+/* Start writing a trace to filename, of the one machine configured to be
+ * traced. Returns -1 and sets errno on failure. */
+int nevm_trace_open(const char *filename);
+
+/* Finish writing the trace. Returns -1 and sets errno if any of it couldn't
+ * be written. */
+int nevm_trace_close(void);
+
+#pragma GCC visibility pop
+
+#endif
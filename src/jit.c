@@ -0,0 +1,305 @@
+/****************************************************************************
+ * jit.c native code emitter for nevm                                       *
+ *                                                                          *
+ * Only x86-64 is supported. The code for a block keeps the base of the     *
+ * VM's memory in rbx, and addresses values in the VM as displacements from *
+ * it. Operations on 32-bit integers with a handful of operators are        *
+ * performed natively; everything else calls the operation's handler, so   *
+ * any operation which can be decoded can be compiled. Each machine has     *
+ * its own buffer, so machines can compile on separate threads; blocks are  *
+ * written into it one after the other, until it is full and everything is  *
+ * thrown away.                                                             *
+ ****************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "ops.h"
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+/* largest displacement from rbx */
+#define JIT_DISP_MAX 0x7FFFFFF0
+
+struct jit_buffer {
+	unsigned char *buf;
+	size_t len; /* length of the finished blocks */
+	size_t cursor; /* end of the block being compiled */
+	bool full;
+};
+
+static void emit(jit_buffer *b, const void *bytes, size_t len) {
+	if (b->cursor + len > JIT_CODE_SIZE) {
+		b->full = true;
+		return;
+	}
+	memcpy(b->buf + b->cursor, bytes, len);
+	b->cursor += len;
+}
+
+#define emit_bytes(b, ...) do {						\
+	static const unsigned char bytes[] = { __VA_ARGS__ };		\
+	emit(b, bytes, sizeof(bytes));					\
+} while (0)
+
+static void emit32(jit_buffer *b, uint32_t v) {
+	emit(b, &v, sizeof(v));
+}
+
+static void emit64(jit_buffer *b, uint64_t v) {
+	emit(b, &v, sizeof(v));
+}
+
+/* op eax or ecx, [rbx + disp32] */
+static void emit_rbx(jit_buffer *b, unsigned char op, unsigned char reg,
+		     uint32_t disp) {
+	unsigned char bytes[2];
+	bytes[0] = op;
+	bytes[1] = 0x83 | (reg << 3);
+	emit(b, bytes, sizeof(bytes));
+	emit32(b, disp);
+}
+
+#define EAX 0
+#define ECX 1
+
+/* call the function at fn, whose arguments have been set up */
+static void emit_call(jit_buffer *b, const void *fn) {
+	emit_bytes(b, 0x48, 0xB8);		/* mov rax, imm64 */
+	emit64(b, (uint64_t) (uintptr_t) fn);
+	emit_bytes(b, 0xFF, 0xD0);		/* call rax */
+}
+
+jit_buffer *jit_new(void) {
+	jit_buffer *b;
+	void *buf;
+	b = malloc(sizeof(jit_buffer));
+	if (b == NULL) {
+		return NULL;
+	}
+	buf = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		free(b);
+		return NULL;
+	}
+	b->buf = buf;
+	jit_reset(b);
+	return b;
+}
+
+void jit_free(jit_buffer *b) {
+	if (b == NULL) {
+		return;
+	}
+	munmap(b->buf, JIT_CODE_SIZE);
+	free(b);
+}
+
+void jit_reset(jit_buffer *b) {
+	b->len = 0;
+	b->cursor = 0;
+	b->full = false;
+}
+
+void jit_begin(jit_buffer *b) {
+	b->cursor = b->len;
+	b->full = false;
+	emit_bytes(b, 0x53);			/* push rbx */
+	emit_bytes(b, 0x48, 0x89, 0xFB);	/* mov rbx, rdi */
+}
+
+void jit_set_ip(jit_buffer *b, uint32_t next) {
+	emit_bytes(b, 0xC7, 0x03);		/* mov dword [rbx], imm32 */
+	emit32(b, next);
+}
+
+static bool is_int32_type(char type) {
+	return type == 'U' || type == 'I' || type == 'u' || type == 'i';
+}
+
+bool jit_op(jit_buffer *b, char op, char dst_type, char src1_type,
+	    char src2_type, uint32_t dst, uint32_t src1, uint32_t src2) {
+	bool unary;
+	unary = op == '=' || op == '~' || op == '!';
+	if (!is_int32_type(dst_type) || !is_int32_type(src1_type)
+	    || (!unary && !is_int32_type(src2_type))
+	    || dst > JIT_DISP_MAX || src1 > JIT_DISP_MAX
+	    || src2 > JIT_DISP_MAX) {
+		return false;
+	}
+	switch (op) {
+	case '=':
+	case '~':
+	case '!':
+	case '+':
+	case '-':
+	case '*':
+	case '&':
+	case '|':
+	case '^':
+	case '<':
+	case '>':
+		break;
+	default:
+		return false;
+	}
+
+	emit_rbx(b, 0x8B, EAX, src1);		/* mov eax, [src1] */
+	switch (op) {
+	case '~':
+		emit_bytes(b, 0xF7, 0xD8);	/* neg eax */
+		break;
+	case '!':
+		emit_bytes(b, 0xF7, 0xD0);	/* not eax */
+		break;
+	case '+':
+		emit_rbx(b, 0x03, EAX, src2);	/* add eax, [src2] */
+		break;
+	case '-':
+		emit_rbx(b, 0x2B, EAX, src2);	/* sub eax, [src2] */
+		break;
+	case '*':
+		emit_bytes(b, 0x0F);		/* imul eax, [src2] */
+		emit_rbx(b, 0xAF, EAX, src2);
+		break;
+	case '&':
+		emit_rbx(b, 0x23, EAX, src2);	/* and eax, [src2] */
+		break;
+	case '|':
+		emit_rbx(b, 0x0B, EAX, src2);	/* or eax, [src2] */
+		break;
+	case '^':
+		emit_rbx(b, 0x33, EAX, src2);	/* xor eax, [src2] */
+		break;
+	case '<':
+		emit_rbx(b, 0x8B, ECX, src2);	/* mov ecx, [src2] */
+		emit_bytes(b, 0xD3, 0xE0);	/* shl eax, cl */
+		break;
+	case '>':
+		emit_rbx(b, 0x8B, ECX, src2);	/* mov ecx, [src2] */
+		if (dst_type == 'I' || dst_type == 'i') {
+			emit_bytes(b, 0xD3, 0xF8);	/* sar eax, cl */
+		} else {
+			emit_bytes(b, 0xD3, 0xE8);	/* shr eax, cl */
+		}
+		break;
+	}
+	emit_rbx(b, 0x89, EAX, dst);		/* mov [dst], eax */
+	return true;
+}
+
+void jit_call(jit_buffer *b, const decoded *d) {
+	emit_bytes(b, 0x48, 0x89, 0xDF);	/* mov rdi, rbx */
+	emit_bytes(b, 0x48, 0xBE);		/* mov rsi, imm64 */
+	emit64(b, (uint64_t) (uintptr_t) d);
+	emit_call(b, (const void *) d->exec);
+}
+
+void jit_check(jit_buffer *b, const uint32_t *tag, uint32_t value,
+	       jit_notify_fn notify, void *arg, uint32_t addr, uint32_t len) {
+	emit_bytes(b, 0x48, 0xB8);		/* mov rax, imm64 */
+	emit64(b, (uint64_t) (uintptr_t) tag);
+	emit_bytes(b, 0x81, 0x38);		/* cmp dword [rax], imm32 */
+	emit32(b, value);
+	emit_bytes(b, 0x75, 32);		/* jne past the call */
+	jit_notify(b, notify, arg, addr, len);
+}
+
+void jit_notify(jit_buffer *b, jit_notify_fn notify, void *arg,
+		uint32_t addr, uint32_t len) {
+	emit_bytes(b, 0x48, 0xBF);		/* mov rdi, imm64 */
+	emit64(b, (uint64_t) (uintptr_t) arg);
+	emit_bytes(b, 0xBE);			/* mov esi, imm32 */
+	emit32(b, addr);
+	emit_bytes(b, 0xBA);			/* mov edx, imm32 */
+	emit32(b, len);
+	emit_call(b, (const void *) notify);
+}
+
+jit_code jit_end(jit_buffer *b, uint32_t nops) {
+	jit_code fn;
+	emit_bytes(b, 0xB8);			/* mov eax, imm32 */
+	emit32(b, nops);
+	emit_bytes(b, 0x5B);			/* pop rbx */
+	emit_bytes(b, 0xC3);			/* ret */
+	if (b->full) {
+		return NULL;
+	}
+	fn = (jit_code) (uintptr_t) (b->buf + b->len);
+	b->len = b->cursor;
+	return fn;
+}
+
+#else
+
+jit_buffer *jit_new(void) {
+	return NULL;
+}
+
+void jit_free(jit_buffer *b) {
+	(void) b;
+}
+
+void jit_reset(jit_buffer *b) {
+	(void) b;
+}
+
+void jit_begin(jit_buffer *b) {
+	(void) b;
+}
+
+void jit_set_ip(jit_buffer *b, uint32_t next) {
+	(void) b;
+	(void) next;
+}
+
+bool jit_op(jit_buffer *b, char op, char dst_type, char src1_type,
+	    char src2_type, uint32_t dst, uint32_t src1, uint32_t src2) {
+	(void) b;
+	(void) op;
+	(void) dst_type;
+	(void) src1_type;
+	(void) src2_type;
+	(void) dst;
+	(void) src1;
+	(void) src2;
+	return false;
+}
+
+void jit_call(jit_buffer *b, const decoded *d) {
+	(void) b;
+	(void) d;
+}
+
+void jit_check(jit_buffer *b, const uint32_t *tag, uint32_t value,
+	       jit_notify_fn notify, void *arg, uint32_t addr, uint32_t len) {
+	(void) b;
+	(void) tag;
+	(void) value;
+	(void) notify;
+	(void) arg;
+	(void) addr;
+	(void) len;
+}
+
+void jit_notify(jit_buffer *b, jit_notify_fn notify, void *arg,
+		uint32_t addr, uint32_t len) {
+	(void) b;
+	(void) notify;
+	(void) arg;
+	(void) addr;
+	(void) len;
+}
+
+jit_code jit_end(jit_buffer *b, uint32_t nops) {
+	(void) b;
+	(void) nops;
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,62 @@
+/****************************************************************************
+ * jit.h native code emitter for nevm                                       *
+ *                                                                          *
+ * This emits straight-line runs of operations as native code. Deciding     *
+ * which operations to compile, and throwing away compiled code when the    *
+ * operations it was compiled from are rewritten, is left to vm.c; this     *
+ * only knows how to write the code.                                        *
+ *                                                                          *
+ * Compiled code is called with the base of the VM's memory, and returns    *
+ * the number of operations it performed.                                   *
+ ****************************************************************************/
+#ifndef JIT_H
+#define JIT_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ops.h"
+
+typedef struct jit_buffer jit_buffer;
+
+typedef uint32_t (*jit_code)(char *mem);
+
+typedef void (*jit_notify_fn)(void *arg, uint32_t addr, uint32_t len);
+
+/* Make a code buffer. Returns NULL if native code isn't supported, or there
+ * isn't the memory for one. */
+jit_buffer *jit_new(void);
+
+/* Free the code buffer, and all the code in it. */
+void jit_free(jit_buffer *b);
+
+/* Throw away all compiled code. */
+void jit_reset(jit_buffer *b);
+
+/* Start compiling a block. */
+void jit_begin(jit_buffer *b);
+
+/* Set the IP to next, as is done before each operation. */
+void jit_set_ip(jit_buffer *b, uint32_t next);
+
+/* Perform an operation, whose arguments have been resolved to addresses,
+ * natively. Returns false, emitting nothing, if the operation and types
+ * aren't supported. */
+bool jit_op(jit_buffer *b, char op, char dst_type, char src1_type,
+	    char src2_type, uint32_t dst, uint32_t src1, uint32_t src2);
+
+/* Perform an operation by calling its handler. */
+void jit_call(jit_buffer *b, const decoded *d);
+
+/* Call notify(arg, addr, len) if *tag is equal to value. */
+void jit_check(jit_buffer *b, const uint32_t *tag, uint32_t value,
+	       jit_notify_fn notify, void *arg, uint32_t addr, uint32_t len);
+
+/* Call notify(arg, addr, len). */
+void jit_notify(jit_buffer *b, jit_notify_fn notify, void *arg,
+		uint32_t addr, uint32_t len);
+
+/* Finish the block, which performs nops operations. Returns NULL if the
+ * code buffer is full. */
+jit_code jit_end(jit_buffer *b, uint32_t nops);
+
+#endif
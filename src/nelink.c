@@ -0,0 +1,456 @@
+/****************************************************************************
+ * nelink.c link modules assembled by neasm -c into one image               *
+ *                                                                          *
+ * The modules are laid out one after another in the order given, each      *
+ * starting on a 16-byte boundary, so that the first must be the one which  *
+ * begins with the IP. Each address a module uses within itself is moved    *
+ * along with it, and each use of a symbol from another module is filled    *
+ * in from the symbols the modules export, which must all be different.     *
+ *                                                                          *
+ * Sources may be given in place of objects, in which case each is          *
+ * assembled to an object beside it first, if it has changed since its      *
+ * object was written, by running neasm -c on as many at once as there      *
+ * are processors.                                                          *
+ ****************************************************************************/
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "arg.h"
+#include "neobj.h"
+
+#define SYMT_LEN 4096
+
+#define fatal(...) do {							\
+	fprintf(stderr, __VA_ARGS__);					\
+	exit(EXIT_FAILURE);						\
+} while (0)
+
+extern char **environ;
+
+struct module {
+	char *filename; /* of the object */
+	char *source; /* to assemble it from, or NULL */
+	pid_t pid; /* of the neasm assembling it, or 0 */
+	char *data; /* the whole object file */
+	neobj_header *h;
+	neobj_symbol *exports;
+	neobj_symbol *imports;
+	uint32_t *relocs;
+	char *image;
+	char *strings;
+	uint32_t base;
+};
+
+/* a symbol exported by a module, in a table by the hash of its name */
+struct export {
+	const char *name;
+	uint32_t addr; /* in the linked image */
+	struct module *module;
+};
+
+static struct module *modules;
+static size_t nmodules;
+static struct export *symt;
+static size_t symt_cap;
+static size_t symt_len;
+
+static void usage() {
+	fatal("usage: %s [-j jobs] [-o file] file ...\n", argv0);
+}
+
+/* assembling */
+
+/* whether filename names a source, rather than an object */
+static bool is_source(const char *filename) {
+	size_t len;
+	len = strlen(filename);
+	return len > 2 && strcmp(filename + len - 2, ".s") == 0;
+}
+
+/* the object for a source: its name with ".neo" for ".s" */
+static char *object_name(const char *source) {
+	char *name;
+	size_t len;
+	len = strlen(source) - 2;
+	name = malloc(len + sizeof(".neo"));
+	if (name == NULL) {
+		fatal("Could not allocate memory for object name\n");
+	}
+	memcpy(name, source, len);
+	strcpy(name + len, ".neo");
+	return name;
+}
+
+/* whether object is missing, or older than source */
+static bool out_of_date(const char *source, const char *object) {
+	struct stat s, o;
+	if (stat(source, &s) != 0) {
+		fatal("Could not open file \"%s\": %s\n",
+		      source, strerror(errno));
+	}
+	if (stat(object, &o) != 0) {
+		return true;
+	}
+	return o.st_mtim.tv_sec < s.st_mtim.tv_sec
+	       || (o.st_mtim.tv_sec == s.st_mtim.tv_sec
+		   && o.st_mtim.tv_nsec < s.st_mtim.tv_nsec);
+}
+
+/* the neasm beside nelink, if nelink was run by path, or on the PATH */
+static char *find_neasm() {
+	char *slash, *path;
+	size_t len;
+	slash = strrchr(argv0, '/');
+	if (slash == NULL) {
+		return "neasm";
+	}
+	len = slash - argv0 + 1;
+	path = malloc(len + sizeof("neasm"));
+	if (path == NULL) {
+		fatal("Could not allocate memory for path\n");
+	}
+	memcpy(path, argv0, len);
+	strcpy(path + len, "neasm");
+	if (access(path, X_OK) != 0) {
+		free(path);
+		return "neasm";
+	}
+	return path;
+}
+
+/* wait for one of the neasms to finish, returning whether it succeeded */
+static bool reap() {
+	pid_t pid;
+	size_t i;
+	int status;
+	do {
+		pid = wait(&status);
+	} while (pid < 0 && errno == EINTR);
+	if (pid < 0) {
+		fatal("Could not wait for neasm: %s\n", strerror(errno));
+	}
+	for (i = 0; i < nmodules && modules[i].pid != pid; i++);
+	if (i == nmodules) {
+		return true;
+	}
+	modules[i].pid = 0;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		return true;
+	}
+	/* don't leave a broken object looking up to date */
+	unlink(modules[i].filename);
+	return false;
+}
+
+/* assemble each source whose object is out of date, jobs at a time */
+static void assemble(long jobs) {
+	char *neasm, *args[6];
+	size_t i;
+	long running = 0;
+	bool ok = true;
+	int err;
+	neasm = find_neasm();
+	for (i = 0; i < nmodules && ok; i++) {
+		if (modules[i].source == NULL
+		    || !out_of_date(modules[i].source, modules[i].filename)) {
+			continue;
+		}
+		if (running == jobs) {
+			ok = reap();
+			running--;
+			if (!ok) {
+				break;
+			}
+		}
+		args[0] = neasm;
+		args[1] = "-c";
+		args[2] = "-o";
+		args[3] = modules[i].filename;
+		args[4] = modules[i].source;
+		args[5] = NULL;
+		err = posix_spawnp(&modules[i].pid, neasm, NULL, NULL, args,
+				   environ);
+		if (err != 0) {
+			fatal("Could not run %s: %s\n", neasm, strerror(err));
+		}
+		running++;
+	}
+	for (; running > 0; running--) {
+		if (!reap()) {
+			ok = false;
+		}
+	}
+	if (!ok) {
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* loading */
+
+static void truncated(struct module *m) {
+	fatal("%s: Object is truncated\n", m->filename);
+}
+
+/* the string at offset name in m's strings */
+static const char *string(struct module *m, uint32_t name) {
+	if (name >= m->h->strings_len) {
+		fatal("%s: Invalid symbol name\n", m->filename);
+	}
+	return m->strings + name;
+}
+
+static void load(struct module *m) {
+	FILE *f;
+	struct stat st;
+	uint64_t len;
+	char *p;
+	f = fopen(m->filename, "r");
+	if (f == NULL) {
+		fatal("Could not open file \"%s\": %s\n",
+		      m->filename, strerror(errno));
+	}
+	if (fstat(fileno(f), &st) != 0) {
+		fatal("Could not stat file \"%s\": %s\n",
+		      m->filename, strerror(errno));
+	}
+	m->data = malloc(st.st_size + 1);
+	if (m->data == NULL) {
+		fatal("Could not allocate memory for \"%s\"\n", m->filename);
+	}
+	if (fread(m->data, 1, st.st_size, f) != (size_t) st.st_size) {
+		fatal("Could not read file \"%s\": %s\n",
+		      m->filename, strerror(errno));
+	}
+	fclose(f);
+	if ((size_t) st.st_size < sizeof(neobj_header)
+	    || memcmp(m->data, NEOBJ_MAGIC, 8) != 0) {
+		fatal("%s: Not an object\n", m->filename);
+	}
+	m->h = (neobj_header *) m->data;
+	if (m->h->version != NEOBJ_VERSION) {
+		fatal("%s: Unsupported object version %u\n",
+		      m->filename, m->h->version);
+	}
+	len = sizeof(neobj_header)
+	      + ((uint64_t) m->h->nexports + m->h->nimports)
+		* sizeof(neobj_symbol)
+	      + (uint64_t) m->h->nrelocs * sizeof(uint32_t)
+	      + m->h->image_len + m->h->strings_len;
+	if (len != (uint64_t) st.st_size) {
+		truncated(m);
+	}
+	p = m->data + sizeof(neobj_header);
+	m->exports = (neobj_symbol *) p;
+	p += m->h->nexports * sizeof(neobj_symbol);
+	m->imports = (neobj_symbol *) p;
+	p += m->h->nimports * sizeof(neobj_symbol);
+	m->relocs = (uint32_t *) p;
+	p += m->h->nrelocs * sizeof(uint32_t);
+	m->image = p;
+	m->strings = p + m->h->image_len;
+	/* so that the last string is terminated, whatever the file says */
+	m->strings[m->h->strings_len] = '\0';
+}
+
+/* symbols */
+
+/* FNV-1a */
+static uint32_t hash(const char *key) {
+	uint32_t h = 2166136261u;
+	while (*key != '\0') {
+		h ^= (unsigned char) *key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* the slot for name in the table, which is either empty or holds it */
+static struct export *slot(const char *name) {
+	size_t i;
+	for (i = hash(name) & (symt_cap - 1); symt[i].name != NULL;
+	     i = (i + 1) & (symt_cap - 1)) {
+		if (strcmp(symt[i].name, name) == 0) {
+			break;
+		}
+	}
+	return &symt[i];
+}
+
+/* double the table, keeping it at most half full */
+static void grow_symt() {
+	struct export *old;
+	size_t old_cap, i;
+	old = symt;
+	old_cap = symt_cap;
+	symt_cap = symt_cap == 0 ? SYMT_LEN : symt_cap * 2;
+	symt = calloc(symt_cap, sizeof(struct export));
+	if (symt == NULL) {
+		fatal("Could not allocate memory for symbol table\n");
+	}
+	for (i = 0; i < old_cap; i++) {
+		if (old[i].name != NULL) {
+			*slot(old[i].name) = old[i];
+		}
+	}
+	free(old);
+}
+
+static void add_exports(struct module *m) {
+	struct export *e;
+	const char *name;
+	uint32_t i;
+	for (i = 0; i < m->h->nexports; i++) {
+		if (symt_len >= symt_cap / 2) {
+			grow_symt();
+		}
+		name = string(m, m->exports[i].name);
+		e = slot(name);
+		if (e->name != NULL) {
+			fatal("Symbol \"%s\" is exported by both %s and %s\n",
+			      name, e->module->filename, m->filename);
+		}
+		e->name = name;
+		e->addr = m->base + m->exports[i].addr;
+		e->module = m;
+		symt_len++;
+	}
+}
+
+/* linking */
+
+/* the word at addr in m's part of out, checking that it is in m */
+static char *word(struct module *m, char *out, uint32_t addr) {
+	if ((uint64_t) addr + 4 > m->h->image_len) {
+		fatal("%s: Address 0x%x is outside the module\n",
+		      m->filename, addr);
+	}
+	return out + m->base + addr;
+}
+
+static void link_module(struct module *m, char *out) {
+	struct export *e;
+	const char *name;
+	uint32_t i, v;
+	char *w;
+	memcpy(out + m->base, m->image, m->h->image_len);
+	for (i = 0; i < m->h->nrelocs; i++) {
+		w = word(m, out, m->relocs[i]);
+		memcpy(&v, w, 4);
+		v += m->base;
+		memcpy(w, &v, 4);
+	}
+	for (i = 0; i < m->h->nimports; i++) {
+		w = word(m, out, m->imports[i].addr);
+		name = string(m, m->imports[i].name);
+		e = symt_cap == 0 ? NULL : slot(name);
+		if (e == NULL || e->name == NULL) {
+			fatal("%s: Unknown symbol \"%s\"\n", m->filename, name);
+		}
+		memcpy(w, &e->addr, 4);
+	}
+}
+
+static void write_image(char *out, uint32_t len, FILE *f, char *outfile) {
+	uint32_t done;
+	ssize_t r;
+	for (done = 0; done < len; done += r) {
+		r = write(fileno(f), out + done, len - done);
+		if (r < 0 && errno == EINTR) {
+			r = 0;
+		} else if (r <= 0) {
+			fatal("Could not write to file \"%s\": %s\n",
+			      outfile, strerror(errno));
+		}
+	}
+	if (fclose(f) != 0) {
+		fatal("Could not write to file \"%s\": %s\n",
+		      outfile, strerror(errno));
+	}
+}
+
+int main(int argc, char **argv) {
+	char *outfile = NULL, *end, *out;
+	FILE *f;
+	long jobs = 0;
+	uint64_t len;
+	size_t i;
+
+	modules = calloc(argc, sizeof(struct module));
+	if (modules == NULL) {
+		fatal("Could not allocate memory for arguments\n");
+	}
+
+	ARGBEGIN {
+	case 'j':
+		jobs = strtol(EARGF(usage()), &end, 0);
+		if (*end != '\0' || jobs <= 0) {
+			usage();
+		}
+		break;
+	case 'o':
+		outfile = EARGF(usage());
+		break;
+	default:
+		usage();
+	ARG:
+		if (is_source(argv[0])) {
+			modules[nmodules].source = argv[0];
+			modules[nmodules].filename = object_name(argv[0]);
+		} else {
+			modules[nmodules].filename = argv[0];
+		}
+		nmodules++;
+	} ARGEND;
+	if (nmodules == 0) {
+		usage();
+	}
+	if (jobs == 0) {
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs <= 0) {
+			jobs = 1;
+		}
+	}
+
+	assemble(jobs);
+
+	/* lay the modules out, and gather what they export */
+	for (i = 0, len = 0; i < nmodules; i++) {
+		load(&modules[i]);
+		len = (len + 15) & ~(uint64_t) 15;
+		if (len + modules[i].h->image_len > UINT32_MAX) {
+			fatal("%s: Image would be larger than 4G\n",
+			      modules[i].filename);
+		}
+		modules[i].base = len;
+		len += modules[i].h->image_len;
+		add_exports(&modules[i]);
+	}
+
+	out = calloc(len + 1, 1);
+	if (out == NULL) {
+		fatal("Could not allocate memory for image\n");
+	}
+	for (i = 0; i < nmodules; i++) {
+		link_module(&modules[i], out);
+	}
+
+	if (outfile == NULL || strcmp(outfile, "-") == 0) {
+		f = stdout;
+		outfile = "<stdout>";
+	} else {
+		f = fopen(outfile, "w");
+		if (f == NULL) {
+			fatal("Could not open file \"%s\": %s\n",
+			      outfile, strerror(errno));
+		}
+	}
+	write_image(out, len, f, outfile);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,46 @@
+/****************************************************************************
+ * nemap.h symbol and line map files                                        *
+ *                                                                          *
+ * neasm writes a map alongside an image, describing where each symbol     *
+ * and each source line ended up, so that nevm can print addresses in terms *
+ * of the source. A map is laid out so that it can be mapped into memory    *
+ * and used as is:                                                          *
+ *                                                                          *
+ *   nemap_header                                                           *
+ *   nemap_symbol[nsymbols], sorted by address                              *
+ *   nemap_line[nlines], sorted by address                                  *
+ *   strings, each terminated by '\0', starting with the source file name   *
+ *                                                                          *
+ * All addresses are relative to the start of the image, and all values    *
+ * are in the byte order of the machine which wrote the map, as with the   *
+ * images themselves.                                                       *
+ ****************************************************************************/
+#ifndef NEMAP_H
+#define NEMAP_H 1
+
+#include <stdint.h>
+
+#define NEMAP_MAGIC "NEMAP\0\0\0"
+#define NEMAP_VERSION 1
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t nsymbols;
+	uint32_t nlines;
+	uint32_t strings_len;
+} nemap_header;
+
+typedef struct {
+	uint32_t addr;
+	uint32_t name; /* offset of the name in the strings */
+} nemap_symbol;
+
+/* the line of the source on which the bytes from addr up to the next
+ * entry were written */
+typedef struct {
+	uint32_t addr;
+	uint32_t lineno;
+} nemap_line;
+
+#endif
@@ -0,0 +1,47 @@
+/****************************************************************************
+ * neobj.h object files                                                     *
+ *                                                                          *
+ * neasm -c writes a module as an object file rather than an image, for     *
+ * nelink to lay out alongside others and link into one image. The image    *
+ * in an object is assembled as though it were loaded at address 0, so      *
+ * every address in it which refers to the module itself is listed, to be   *
+ * moved along with the module, and every address which refers to a symbol  *
+ * defined in another module is left as 0, to be filled in. An object file  *
+ * is laid out as:                                                          *
+ *                                                                          *
+ *   neobj_header                                                           *
+ *   neobj_symbol[nexports], the symbols other modules may use              *
+ *   neobj_symbol[nimports], where symbols from other modules are used      *
+ *   uint32_t[nrelocs], where addresses within the module are used          *
+ *   the image, image_len bytes                                             *
+ *   strings, each terminated by '\0'                                       *
+ *                                                                          *
+ * All values are in the byte order of the machine which wrote the object,  *
+ * as with the images themselves.                                           *
+ ****************************************************************************/
+#ifndef NEOBJ_H
+#define NEOBJ_H 1
+
+#include <stdint.h>
+
+#define NEOBJ_MAGIC "NEOBJ\0\0\0"
+#define NEOBJ_VERSION 1
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t image_len;
+	uint32_t nexports;
+	uint32_t nimports;
+	uint32_t nrelocs;
+	uint32_t strings_len;
+} neobj_header;
+
+/* for an export, the address the symbol stands for; for an import, the
+ * address of the word to fill in with it */
+typedef struct {
+	uint32_t addr;
+	uint32_t name; /* offset of the name in the strings */
+} neobj_symbol;
+
+#endif
@@ -0,0 +1,280 @@
+/****************************************************************************
+ * netrace.c replay and summarize traces written by nevm -t                 *
+ *                                                                          *
+ * The trace is replayed into a sparse copy of the machine's memory, in     *
+ * chunks allocated as they are first written, counting operations as it   *
+ * goes. Replay can stop after any number of operations, and the memory at *
+ * that point written out as an image which nevm can load and run from.     *
+ ****************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "arg.h"
+#include "trace.h"
+
+#define CHUNK_BITS 16
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+#define NCHUNKS (1 << (32 - CHUNK_BITS))
+#define TOP_SLOTS 10
+
+#define fatal(...) do {							\
+	fprintf(stderr, __VA_ARGS__);					\
+	exit(EXIT_FAILURE);						\
+} while (0)
+
+static char *chunks[NCHUNKS];
+static unsigned long *slot_counts[NCHUNKS];
+static uint64_t mem_end; /* end of the highest byte written */
+
+static FILE *in;
+static char *infile;
+
+static char *chunk(uint32_t addr) {
+	char **c;
+	c = &chunks[addr >> CHUNK_BITS];
+	if (*c == NULL) {
+		*c = calloc(1, CHUNK_SIZE);
+		if (*c == NULL) {
+			fatal("Could not allocate memory\n");
+		}
+	}
+	return *c;
+}
+
+static void count_slot(uint32_t ip) {
+	unsigned long **c;
+	c = &slot_counts[ip >> CHUNK_BITS];
+	if (*c == NULL) {
+		*c = calloc(CHUNK_SIZE / 16, sizeof(unsigned long));
+		if (*c == NULL) {
+			fatal("Could not allocate memory\n");
+		}
+	}
+	(*c)[(ip & (CHUNK_SIZE - 1)) / 16]++;
+}
+
+static void truncated() {
+	fatal("%s: Trace is truncated\n", infile);
+}
+
+static uint64_t read_varint() {
+	uint64_t v;
+	int c, shift;
+	v = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		c = getc(in);
+		if (c == EOF) {
+			truncated();
+		}
+		v |= (uint64_t) (c & 0x7F) << shift;
+		if (!(c & 0x80)) {
+			return v;
+		}
+	}
+	fatal("%s: Invalid varint\n", infile);
+}
+
+/* read len bytes from the trace into memory at addr */
+static void read_memory(uint64_t addr, uint64_t len) {
+	uint32_t n;
+	if (addr + len > (uint64_t) UINT32_MAX + 1) {
+		fatal("%s: Write past the end of memory at 0x%llx\n",
+		      infile, (unsigned long long) addr);
+	}
+	if (addr + len > mem_end) {
+		mem_end = addr + len;
+	}
+	while (len > 0) {
+		n = CHUNK_SIZE - (addr & (CHUNK_SIZE - 1));
+		if (n > len) {
+			n = len;
+		}
+		if (fread(chunk(addr) + (addr & (CHUNK_SIZE - 1)), 1, n,
+			  in) != n) {
+			truncated();
+		}
+		addr += n;
+		len -= n;
+	}
+}
+
+static void write_image(char *outfile) {
+	FILE *out;
+	uint64_t addr;
+	size_t n;
+	static const char zeros[CHUNK_SIZE];
+	const char *c;
+	out = fopen(outfile, "w");
+	if (out == NULL) {
+		fatal("Could not open file \"%s\": %s\n",
+		      outfile, strerror(errno));
+	}
+	for (addr = 0; addr < mem_end; addr += n) {
+		n = mem_end - addr < CHUNK_SIZE
+		    ? mem_end - addr : CHUNK_SIZE;
+		c = chunks[addr >> CHUNK_BITS];
+		if (fwrite(c != NULL ? c : zeros, 1, n, out) != n) {
+			fatal("Could not write to file \"%s\": %s\n",
+			      outfile, strerror(errno));
+		}
+	}
+	if (fclose(out) != 0) {
+		fatal("Could not write to file \"%s\": %s\n",
+		      outfile, strerror(errno));
+	}
+}
+
+static void print_top_slots() {
+	uint32_t top[TOP_SLOTS];
+	unsigned long top_count[TOP_SLOTS], count;
+	size_t i, j, k, ntop;
+	ntop = 0;
+	for (i = 0; i < NCHUNKS; i++) {
+		if (slot_counts[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < CHUNK_SIZE / 16; j++) {
+			count = slot_counts[i][j];
+			if (count == 0) {
+				continue;
+			}
+			/* insert into the sorted list of the busiest */
+			for (k = ntop; k > 0 && top_count[k - 1] < count;
+			     k--) {
+				if (k < TOP_SLOTS) {
+					top[k] = top[k - 1];
+					top_count[k] = top_count[k - 1];
+				}
+			}
+			if (k < TOP_SLOTS) {
+				top[k] = (uint32_t) ((i << CHUNK_BITS)
+						     + j * 16);
+				top_count[k] = count;
+				if (ntop < TOP_SLOTS) {
+					ntop++;
+				}
+			}
+		}
+	}
+	printf("Busiest slots:\n");
+	for (i = 0; i < ntop; i++) {
+		printf("  0x%08x %12lu\n", top[i], top_count[i]);
+	}
+}
+
+static void usage() {
+	fatal("usage: %s [-n steps] [-o image] trace\n", argv0);
+}
+
+int main(int argc, char **argv) {
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	char op[4];
+	char *outfile = NULL, *end;
+	unsigned long long steps = 0, max_steps = 0;
+	unsigned long long op_counts[256], writes = 0, written = 0;
+	bool limited = false, halted = false;
+	uint64_t v, len;
+	uint32_t ip = 0, write_addr = 0;
+	int c;
+	size_t i;
+
+	ARGBEGIN {
+	case 'n':
+		max_steps = strtoull(EARGF(usage()), &end, 0);
+		if (*end != '\0') {
+			usage();
+		}
+		limited = true;
+		break;
+	case 'o':
+		outfile = EARGF(usage());
+		break;
+	default:
+		usage();
+	ARG:
+		if (infile != NULL) {
+			usage();
+		}
+		infile = argv[0];
+	} ARGEND;
+	if (infile == NULL) {
+		usage();
+	}
+
+	in = fopen(infile, "r");
+	if (in == NULL) {
+		fatal("Could not open file \"%s\": %s\n",
+		      infile, strerror(errno));
+	}
+	if (fread(magic, 1, sizeof(magic), in) != sizeof(magic)
+	    || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+		fatal("%s: Not a trace\n", infile);
+	}
+
+	memset(op_counts, 0, sizeof(op_counts));
+	for (;;) {
+		c = getc(in);
+		if (c == EOF) {
+			/* the machine stopped without halting */
+			break;
+		}
+		ungetc(c, in);
+		v = read_varint();
+		switch (v & 3) {
+		case TRACE_OP:
+			if (limited && steps == max_steps) {
+				goto done;
+			}
+			ip = (uint32_t) (ip + 16 + unzigzag(v >> 2));
+			/* the IP is advanced before each operation */
+			*(uint32_t *) chunk(0) = ip + 16;
+			if (mem_end < sizeof(uint32_t)) {
+				mem_end = sizeof(uint32_t);
+			}
+			if (fread(op, 1, sizeof(op), in) != sizeof(op)) {
+				truncated();
+			}
+			op_counts[(unsigned char) op[0]]++;
+			count_slot(ip);
+			steps++;
+			break;
+		case TRACE_WRITE:
+			write_addr = (uint32_t) (write_addr
+						 + unzigzag(v >> 2));
+			len = read_varint();
+			read_memory(write_addr, len);
+			writes++;
+			written += len;
+			break;
+		case TRACE_MEMORY:
+			len = read_varint();
+			read_memory(v >> 2, len);
+			break;
+		case TRACE_END:
+			halted = true;
+			goto done;
+		}
+	}
+done:
+	fclose(in);
+
+	printf("%llu operations, %llu writes of %llu bytes%s\n",
+	       steps, writes, written,
+	       halted ? ", then halted"
+	       : limited && steps == max_steps ? ""
+	       : ", then stopped without halting");
+	printf("Operations:\n");
+	for (i = 0; i < 256; i++) {
+		if (op_counts[i] != 0) {
+			printf("  %c %12llu\n", (int) i, op_counts[i]);
+		}
+	}
+	print_top_slots();
+	if (outfile != NULL) {
+		write_image(outfile);
+	}
+	return EXIT_SUCCESS;
+}
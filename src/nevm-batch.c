@@ -0,0 +1,455 @@
+/****************************************************************************
+ * nevm-batch.c run many machines at once                                   *
+ *                                                                          *
+ * Each line of the job file describes one machine, with the files to load  *
+ * into it given just as they are to nevm. Every machine is run headless,   *
+ * to its halt or its failure, on a pool of threads, and then the result of *
+ * each is printed, in the order of the job file: whether it halted, what   *
+ * went wrong if it didn't, and what was on its screen at the end.          *
+ *                                                                          *
+ * The jobs are dealt out evenly to the threads at the start. A thread      *
+ * takes its jobs from the front of its own share, and when it runs out,    *
+ * steals the back half of another thread's remaining share, so that        *
+ * threads whose machines happen to finish quickly end up running more of   *
+ * them. Machines share nothing, so the only locking is around the shares.  *
+ ****************************************************************************/
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include "arg.h"
+#include "nevm.h"
+
+#define fatal(...) do {							\
+	fprintf(stderr, __VA_ARGS__);					\
+	exit(EXIT_FAILURE);						\
+} while (0)
+
+/* one file to load into a machine, as for nevm */
+struct load {
+	char *filename;
+	bool snapshot;
+	bool located;
+	uint32_t location;
+};
+
+struct job {
+	unsigned long lineno;
+	struct load *loads;
+	size_t nloads;
+	/* results */
+	bool failed;
+	bool paused; /* ran out of operations */
+	char *error;
+	bool has_screen;
+	char screen[SCREEN_LEN];
+	uint64_t ops;
+	size_t shared; /* pages still shared with the files loaded */
+	size_t owned; /* pages of its own */
+};
+
+/* a thread, and its share of the jobs */
+struct worker {
+	pthread_t thread;
+	size_t id;
+	pthread_mutex_t lock;
+	size_t head; /* next job to run */
+	size_t tail; /* end of the share */
+	unsigned long run;
+	unsigned long stolen;
+};
+
+static nevm_config config;
+static uint64_t max_steps = 0;
+static struct job *jobs = NULL;
+static size_t njobs = 0;
+static struct worker *workers = NULL;
+static size_t nworkers = 0;
+static char *jobfile;
+
+static void usage() {
+	fatal("%s [-i] [-j threads] [-m limit] [-n steps] [-s] [-u] jobs\n",
+	      argv0);
+}
+
+/* parsing the job file */
+
+static void *alloc(size_t size) {
+	void *p;
+	p = malloc(size);
+	if (p == NULL) {
+		fatal("Could not allocate memory\n");
+	}
+	return p;
+}
+
+/* split line into its words, in place */
+static size_t split(char *line, char **words) {
+	size_t n;
+	n = 0;
+	for (;;) {
+		while (isspace((unsigned char) *line)) {
+			line++;
+		}
+		if (*line == '\0') {
+			return n;
+		}
+		words[n++] = line;
+		while (*line != '\0' && !isspace((unsigned char) *line)) {
+			line++;
+		}
+		if (*line != '\0') {
+			*line++ = '\0';
+		}
+	}
+}
+
+static void parse_job(struct job *job, char *line) {
+	char **words, *end;
+	size_t nwords, i;
+	bool located = false;
+	unsigned long location = 0;
+
+	words = alloc((strlen(line) / 2 + 1) * sizeof(char *));
+	nwords = split(line, words);
+	job->loads = alloc(nwords * sizeof(struct load));
+	job->nloads = 0;
+	for (i = 0; i < nwords; i++) {
+		if (strcmp(words[i], "-l") == 0 && i + 1 < nwords) {
+			location = strtoul(words[++i], &end, 0);
+			if (*end != '\0' || location > UINT32_MAX) {
+				fatal("%s:%lu: Invalid location \"%s\"\n",
+				      jobfile, job->lineno, words[i]);
+			}
+			located = true;
+		} else if (strcmp(words[i], "-c") == 0 && i + 1 < nwords) {
+			if (job->nloads != 0) {
+				fatal("%s:%lu: A snapshot must come before"
+				      " any files\n", jobfile, job->lineno);
+			}
+			job->loads[job->nloads].filename = words[++i];
+			job->loads[job->nloads].snapshot = true;
+			job->loads[job->nloads].located = false;
+			job->nloads++;
+		} else if (words[i][0] == '-' && words[i][1] != '\0') {
+			fatal("%s:%lu: Invalid option \"%s\"\n",
+			      jobfile, job->lineno, words[i]);
+		} else {
+			job->loads[job->nloads].filename = words[i];
+			job->loads[job->nloads].snapshot = false;
+			job->loads[job->nloads].located = located;
+			job->loads[job->nloads].location = location;
+			job->nloads++;
+			located = false;
+		}
+	}
+	free(words);
+}
+
+static void read_jobs() {
+	FILE *f;
+	char *line = NULL, *p;
+	size_t size = 0, jobs_size = 0;
+	ssize_t len;
+	unsigned long lineno = 0;
+
+	if (strcmp(jobfile, "-") == 0) {
+		f = stdin;
+	} else {
+		f = fopen(jobfile, "r");
+	}
+	if (f == NULL) {
+		fatal("Couldn't open file \"%s\": %s\n",
+		      jobfile, strerror(errno));
+	}
+	while ((len = getline(&line, &size, f)) >= 0) {
+		lineno++;
+		for (p = line; isspace((unsigned char) *p); p++);
+		if (*p == '\0' || *p == '#') {
+			continue;
+		}
+		if (njobs == jobs_size) {
+			jobs_size = jobs_size == 0 ? 64 : jobs_size * 2;
+			jobs = realloc(jobs, jobs_size * sizeof(struct job));
+			if (jobs == NULL) {
+				fatal("Could not allocate memory\n");
+			}
+		}
+		memset(&jobs[njobs], 0, sizeof(struct job));
+		jobs[njobs].lineno = lineno;
+		/* the words point into the line, so keep it */
+		p = strdup(p);
+		if (p == NULL) {
+			fatal("Could not allocate memory\n");
+		}
+		parse_job(&jobs[njobs], p);
+		njobs++;
+	}
+	if (ferror(f)) {
+		fatal("Couldn't read from file \"%s\": %s\n",
+		      jobfile, strerror(errno));
+	}
+	free(line);
+	if (f != stdin) {
+		fclose(f);
+	}
+}
+
+/* running the jobs */
+
+static void job_failed(struct job *job, const char *error) {
+	job->failed = true;
+	job->error = strdup(error);
+}
+
+static void run_job(struct job *job) {
+	nevm *vm;
+	uint32_t cursor = 0;
+	size_t i;
+	int r = 0;
+
+	vm = nevm_new(&config);
+	if (vm == NULL) {
+		job_failed(job, "Could not allocate memory for the machine\n");
+		return;
+	}
+	for (i = 0; i < job->nloads && r == 0; i++) {
+		if (job->loads[i].snapshot) {
+			r = nevm_restore_snapshot(vm, job->loads[i].filename);
+			continue;
+		}
+		if (job->loads[i].located) {
+			cursor = job->loads[i].location;
+		}
+		r = nevm_load_file(vm, &cursor, job->loads[i].filename);
+	}
+	if (r == 0) {
+		r = nevm_run(vm, max_steps);
+		job->paused = r == NEVM_PAUSED;
+	}
+	if (r == NEVM_FAILED) {
+		job_failed(job, nevm_error(vm));
+	}
+	if (nevm_brk(vm) >= SCREEN_END) {
+		memcpy(job->screen, nevm_mem(vm) + SCREEN_START, SCREEN_LEN);
+		job->has_screen = true;
+	}
+	job->ops = nevm_steps(vm);
+	if (nevm_count_pages(vm, &job->shared, &job->owned) != 0) {
+		job->shared = 0;
+		job->owned = 0;
+	}
+	nevm_free(vm);
+}
+
+/* take the next job from w's own share */
+static bool take(struct worker *w, size_t *job) {
+	bool found;
+	pthread_mutex_lock(&w->lock);
+	found = w->head < w->tail;
+	if (found) {
+		*job = w->head++;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return found;
+}
+
+/* move the back half of another worker's share to w, whose own share is
+ * empty */
+static bool steal(struct worker *w) {
+	struct worker *victim;
+	size_t i, n, head, tail;
+	for (i = 1; i < nworkers; i++) {
+		victim = &workers[(w->id + i) % nworkers];
+		pthread_mutex_lock(&victim->lock);
+		n = victim->tail - victim->head;
+		tail = victim->tail;
+		head = tail - (n + 1) / 2;
+		victim->tail = head;
+		pthread_mutex_unlock(&victim->lock);
+		if (n != 0) {
+			pthread_mutex_lock(&w->lock);
+			w->head = head;
+			w->tail = tail;
+			pthread_mutex_unlock(&w->lock);
+			w->stolen += tail - head;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void *work(void *arg) {
+	struct worker *w;
+	size_t job;
+	w = arg;
+	for (;;) {
+		while (take(w, &job)) {
+			run_job(&jobs[job]);
+			w->run++;
+		}
+		if (!steal(w)) {
+			return NULL;
+		}
+	}
+}
+
+static void run_jobs() {
+	size_t i;
+	int err;
+	workers = alloc(nworkers * sizeof(struct worker));
+	/* deal out the jobs evenly */
+	for (i = 0; i < nworkers; i++) {
+		workers[i].id = i;
+		pthread_mutex_init(&workers[i].lock, NULL);
+		workers[i].head = njobs * i / nworkers;
+		workers[i].tail = njobs * (i + 1) / nworkers;
+		workers[i].run = 0;
+		workers[i].stolen = 0;
+	}
+	for (i = 0; i < nworkers; i++) {
+		err = pthread_create(&workers[i].thread, NULL, work,
+				     &workers[i]);
+		if (err != 0) {
+			fatal("Could not start thread: %s\n", strerror(err));
+		}
+	}
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+}
+
+int main(int argc, char **argv) {
+	struct timespec started, finished;
+	unsigned long long limit;
+	unsigned long stolen = 0;
+	uint64_t ops = 0;
+	size_t i, failed = 0, shared = 0, owned = 0;
+	long threads = 0;
+	bool stats = false;
+	char *end;
+
+	nevm_config_default(&config);
+
+	ARGBEGIN {
+	case 'i':
+		/* interpret only, without compiling to native code */
+		config.jit = false;
+		break;
+	case 'j':
+		/* set the number of threads */
+		threads = strtol(EARGF(usage()), &end, 0);
+		if (*end != '\0' || threads <= 0) {
+			usage();
+		}
+		break;
+	case 'm':
+		/* set the limit on memory */
+		limit = strtoull(EARGF(usage()), &end, 0);
+		switch (*end) {
+		case 'g':
+		case 'G':
+			limit <<= 10;
+			/* fall through */
+		case 'm':
+		case 'M':
+			limit <<= 10;
+			/* fall through */
+		case 'k':
+		case 'K':
+			limit <<= 10;
+			end++;
+			break;
+		}
+		if (*end != '\0' || limit == 0) {
+			usage();
+		}
+		config.brk_max = limit > UINT32_MAX
+				 ? UINT32_MAX : (uint32_t) limit;
+		break;
+	case 'n':
+		/* stop each machine after so many operations */
+		max_steps = strtoull(EARGF(usage()), &end, 0);
+		if (*end != '\0' || max_steps == 0) {
+			usage();
+		}
+		break;
+	case 's':
+		/* print statistics on exit */
+		stats = true;
+		break;
+	case 'u':
+		/* leave range checks to guard pages */
+		config.guard = true;
+		break;
+	default:
+		usage();
+	ARG:
+		if (jobfile != NULL) {
+			usage();
+		}
+		jobfile = argv[0];
+	} ARGEND;
+	if (jobfile == NULL) {
+		usage();
+	}
+
+	read_jobs();
+	if (njobs == 0) {
+		fatal("%s: No jobs\n", jobfile);
+	}
+	if (threads == 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	nworkers = threads < 1 ? 1
+		   : (size_t) threads > njobs ? njobs : (size_t) threads;
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	run_jobs();
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+
+	for (i = 0; i < njobs; i++) {
+		printf("== %s:%lu: %s", jobfile, jobs[i].lineno,
+		       jobs[i].failed ? "failed"
+		       : jobs[i].paused ? "stopped" : "halted");
+		if (stats) {
+			printf(", %zu pages shared, %zu private",
+			       jobs[i].shared, jobs[i].owned);
+		}
+		putchar('\n');
+		if (jobs[i].failed) {
+			fputs(jobs[i].error, stdout);
+			failed++;
+		}
+		if (jobs[i].has_screen) {
+			nevm_print_screen(jobs[i].screen, stdout);
+		}
+		ops += jobs[i].ops;
+		shared += jobs[i].shared;
+		owned += jobs[i].owned;
+	}
+	fflush(stdout);
+	if (stats) {
+		for (i = 0; i < nworkers; i++) {
+			stolen += workers[i].stolen;
+		}
+		fprintf(stderr, "Ran %zu machines, %zu of which failed, on"
+			" %zu threads in %.3f seconds\n", njobs, failed,
+			nworkers,
+			(double) (finished.tv_sec - started.tv_sec)
+			+ (double) (finished.tv_nsec - started.tv_nsec)
+			  / 1e9);
+		fprintf(stderr, "%" PRIu64 " operations, %lu machines stolen\n",
+			ops, stolen);
+		fprintf(stderr, "%zu pages shared with loaded files,"
+			" %zu private\n", shared, owned);
+	}
+	exit(failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
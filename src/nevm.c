@@ -1,32 +1,20 @@
 /****************************************************************************
- * nevm.c virtual machine for the noneleatic languages                      *
+ * nevm.c terminal front end for the noneleatic virtual machine             *
  *                                                                          *
- * This virtual machine follows closely to the spec in doc/machine.txt      *
- * It makes no effort to make up for big/little endian differences in the   *
- * underlying machine, and so some programs won't work the same when the VM *
- * is compiled for a machine of different endianness from the one on which  *
- * the program was written.                                                 *
- *                                                                          *
- * The general run strategy is:                                             *
- * (1) update displays                                                      *
- * (2) read IP, read and parse opcode                                       *
- * (3) advance IP - it is crucial to advance IP before actually executing   *
- *     the operation, as this way changes the operation makes to the IP     *
- *     will be reflected in the next opcode read.                           *
- * (3) execute opcode using underlying c instruction, first casting all     *
- *     data types to the opcode's return type.                              *
- *                                                                          *
- * The memory is managed as a flat, malloc'd pointer. Whenever a read or    *
- * write is made outside of the malloc'd area, the pointer is realloc'd to  *
- * be large enough to accomodate the memory. A proper implementation would  *
- * allow for sparsely allocated memory, but this isn't a proper             *
- * implementation.                                                          *
+ * The machine itself is in libnevm (see nevm.h); this parses the           *
+ * arguments, loads files into a machine, and shows its screen on the       *
+ * terminal with curses as it runs, or prints it at the end when running    *
+ * without a terminal. In console mode the screen is an output stream       *
+ * instead, written to stdout as the machine runs, for use in pipelines.    *
  ****************************************************************************/
 #include <curses.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <time.h>
-#include <ctype.h>
 #include <unistd.h>
+#include <ctype.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,447 +22,51 @@
 #include <stdio.h>
 #include <math.h>
 #include "arg.h"
+#include "nevm.h"
 
-#define SCREEN_ROWS 25
-#define SCREEN_COLS 80
-#define SCREEN_START 0xF000
-#define SCREEN_LEN (SCREEN_ROWS * SCREEN_COLS)
-#define SCREEN_END (SCREEN_START + SCREEN_LEN)
 #define DEBUG_DEFAULT_WAIT 2
 #define DEBUG_SCREEN_COLS 45
-
-typedef struct {
-	char op;
-	char dst_type;
-	char src1_type;
-	char src2_type;
-	union {
-		uint32_t u;
-		int32_t i;
-		float f;
-	} dst;
-	union {
-		uint32_t u;
-		int32_t i;
-		float f;
-	} src1;
-	union {
-		uint32_t u;
-		int32_t i;
-		float f;
-	} src2;
-} operation;
+#define STREAM_DEFAULT_LEN 256
 
 /* the debugging screen */
 WINDOW *debugscr = NULL;
 
-/* configuration for the VM */
-static struct {
-	uint32_t brk_max;
-	struct timespec delay;
-} config = { 0xFFFF, { 0, 0 } };
+/* the machine's screen */
+static WINDOW *screen = NULL;
 
-/* a representation of the machine */
+/* options which are nothing to do with the machine itself */
 static struct {
-	char *mem;
-	uint32_t brk;
-	WINDOW *screen;
-} machine = { NULL, 0, NULL };
+	bool headless;
+	bool console;
+	bool stats;
+	char *profile;
+	char *trace;
+	char *snapshot;
+} options = { false, false, false, NULL, NULL, NULL };
+
+/* a file to load, or a snapshot to restore, in the order given */
+struct load {
+	char *filename;
+	bool snapshot;
+	bool located; /* whether a location was given */
+	uint32_t location;
+};
 
 #define fatal(...) do {							\
-	endwin();							\
+	if (screen != NULL) {						\
+		endwin();						\
+	}								\
 	fprintf(stderr, __VA_ARGS__);					\
 	exit(EXIT_FAILURE);						\
 } while (0)
 
+/* display update routines */
 
-/* memory translation and addressing */
-
-#define caddr2addr(caddr)						\
-	 ((uint32_t) (((char *) (caddr)) - machine.mem))
-
-#define addr2caddr(addr)						\
-	 (machine.mem + (addr))
+#define addr2caddr(addr) (mem + (addr))
 
 #define indirect(addr, ctype)						\
 	(*((ctype *) addr2caddr(addr)))
 
-#define valaddr(arg, type)						\
-	(  (type) == 'U' ? caddr2addr(&(arg).u)				\
-	 : (type) == 'I' ? caddr2addr(&(arg).u)				\
-	 : (type) == 'F' ? caddr2addr(&(arg).u)				\
-	 : (arg).u)
-
-#define valsize(type)							\
-	(  (type) == 'U' ? (uint32_t) 4					\
-	 : (type) == 'I' ? (uint32_t) 4					\
-	 : (type) == 'F' ? (uint32_t) 4					\
-	 : (type) == 'z' ? (uint32_t) 8					\
-	 : (type) == 'l' ? (uint32_t) 8					\
-	 : (type) == 'd' ? (uint32_t) 8					\
-	 : (type) == 'u' ? (uint32_t) 4					\
-	 : (type) == 'i' ? (uint32_t) 4					\
-	 : (type) == 'f' ? (uint32_t) 4					\
-	 : (type) == 'h' ? (uint32_t) 2					\
-	 : (type) == 's' ? (uint32_t) 2					\
-	 : (type) == 'c' ? (uint32_t) 1					\
-	 : (type) == 'b' ? (uint32_t) 1					\
-	 : (uint32_t) 0)
-
-#define val(arg, type, ctype)						\
-	(  (type) == 'U' ? (ctype) (arg).u				\
-	 : (type) == 'I' ? (ctype) (arg).i				\
-	 : (type) == 'F' ? (ctype) (arg).f				\
-	 : (type) == 'z' ? (ctype) indirect((arg).u, uint64_t)		\
-	 : (type) == 'l' ? (ctype) indirect((arg).u, int64_t)		\
-	 : (type) == 'd' ? (ctype) indirect((arg).u, double)		\
-	 : (type) == 'u' ? (ctype) indirect((arg).u, uint32_t)		\
-	 : (type) == 'i' ? (ctype) indirect((arg).u, int32_t)		\
-	 : (type) == 'f' ? (ctype) indirect((arg).u, float)		\
-	 : (type) == 'h' ? (ctype) indirect((arg).u, uint16_t)		\
-	 : (type) == 's' ? (ctype) indirect((arg).u, int16_t)		\
-	 : (type) == 'c' ? (ctype) indirect((arg).u, uint8_t)		\
-	 : (type) == 'b' ? (ctype) indirect((arg).u, int8_t)		\
-	 : (ctype) 0)
-
-
-/* memory management */
-
-static int check_brk(uint32_t addr) {
-	if (addr > machine.brk) {
-		void *newmem;
-		if (addr > config.brk_max) {
-			errno = ENOMEM;
-			return -1;
-		}
-		newmem = realloc(machine.mem, addr);
-		if (newmem == NULL) {
-			return -1;
-		}
-		machine.mem = newmem;
-		machine.brk = addr;
-	}
-	return 0;
-}
-
-static void assert_brk(uint32_t addr, uint32_t addr_addr) {
-	if (check_brk(addr) != 0) {
-		fatal("0x%x:Could not create memory for address at 0x%x: 0x%x\n",
-		      indirect(0, uint32_t), addr_addr, addr);
-	}
-}
-
-
-/* validation */
-
-static bool is_arg_type(char arg_type) {
-	switch (arg_type) {
-	case 'U':
-	case 'I':
-	case 'F':
-	case 'z':
-	case 'l':
-	case 'd':
-	case 'u':
-	case 'i':
-	case 'f':
-	case 'h':
-	case 's':
-	case 'c':
-	case 'b':
-		return true;
-	default:
-		return false;
-	}
-}
-
-static void validate_arg(uint32_t addr, char arg_type,
-			 uint32_t addr_addr, uint32_t arg_type_addr) {
-	switch (arg_type) {
-	case 'U':
-	case 'I':
-	case 'F':
-		break;
-	case 'z':
-	case 'l':
-	case 'd':
-		assert_brk(addr + 8, addr_addr);
-		break;
-	case 'u':
-	case 'i':
-	case 'f':
-		assert_brk(addr + 4, addr_addr);
-		break;
-	case 'h':
-	case 's':
-		assert_brk(addr + 2, addr_addr);
-		break;
-	case 'c':
-	case 'b':
-		assert_brk(addr + 1, addr_addr);
-		break;
-	default:
-		fatal("0x%x:Invalid type at 0x%x: %c\n",
-		      indirect(0, uint32_t), arg_type_addr, arg_type);
-	}
-}
-
-static bool is_op(char op) {
-	switch (op) {
-	case '_': /* No op */
-	case '=': /* Assign */
-	case '@': /* Block transfer */
-	case '!': /* Not */
-	case '&': /* And */
-	case '|': /* Or */
-	case '^': /* Xor */
-	case '<': /* Shift left */
-	case '>': /* Shift right */
-	case '~': /* Negate */
-	case '+': /* Add */
-	case '-': /* Subtract */
-	case '*': /* Multiply */
-	case '/': /* Divide */
-	case '%': /* Remainder */
-	case '#': /* Halt */
-		return true;
-	default:
-		return false;
-	}
-}
-
-static void validate_op(char op, uint32_t op_addr) {
-	if (!is_op(op)) {
-		fatal("0x%x:Invalid operation at 0x%x: %c\n",
-		      indirect(0, uint32_t), op_addr, op);
-	}
-}
-
-/* macros for translating between operations and C operations */
-
-#define unary_op(op, cop)						\
-do {									\
-	switch (op->dst_type) {						\
-	case 'U':							\
-		op->dst.u = cop val(op->src1, op->src1_type, uint32_t); \
-		break;							\
-	case 'I':							\
-		op->dst.i = cop val(op->src1, op->src1_type, int32_t);	\
-		break;							\
-	case 'F':							\
-		op->dst.f = cop val(op->src1, op->src1_type, float);	\
-		break;							\
-	case 'z':							\
-		indirect(op->dst.u, uint64_t)				\
-			= cop val(op->src1, op->src1_type, uint64_t);	\
-		break;							\
-	case 'l':							\
-		indirect(op->dst.u, int64_t)				\
-			= cop val(op->src1, op->src1_type, int64_t);	\
-		break;							\
-	case 'd':							\
-		indirect(op->dst.u, double)				\
-			= cop val(op->src1, op->src1_type, double);	\
-		break;							\
-	case 'u':							\
-		indirect(op->dst.u, uint32_t)				\
-			= cop val(op->src1, op->src1_type, uint32_t);	\
-		break;							\
-	case 'i':							\
-		indirect(op->dst.u, int32_t)				\
-			= cop val(op->src1, op->src1_type, int32_t);	\
-		break;							\
-	case 'f':							\
-		indirect(op->dst.u, float)				\
-			= cop val(op->src1, op->src1_type, float);	\
-		break;							\
-	case 'h':							\
-		indirect(op->dst.u, uint16_t)				\
-			= cop val(op->src1, op->src1_type, uint16_t);	\
-		break;							\
-	case 's':							\
-		indirect(op->dst.u, int16_t)				\
-			= cop val(op->src1, op->src1_type, int16_t);	\
-		break;							\
-	case 'c':							\
-		indirect(op->dst.u, uint8_t)				\
-			= cop val(op->src1, op->src1_type, uint8_t);	\
-		break;							\
-	case 'b':							\
-		indirect(op->dst.u, int8_t)				\
-			= cop val(op->src1, op->src1_type, int8_t);	\
-		break;							\
-	}								\
-} while (0)
-
-#define unary_op_nofloat(op, cop)					\
-do {									\
-	switch (op->dst_type) {						\
-	case 'U':							\
-		op->dst.u = cop val(op->src1, op->src1_type, uint32_t); \
-		break;							\
-	case 'I':							\
-		op->dst.i = cop val(op->src1, op->src1_type, int32_t);	\
-		break;							\
-	case 'z':							\
-		indirect(op->dst.u, uint64_t)				\
-			= cop val(op->src1, op->src1_type, uint64_t);	\
-		break;							\
-	case 'l':							\
-		indirect(op->dst.u, int64_t)				\
-			= cop val(op->src1, op->src1_type, int64_t);	\
-		break;							\
-	case 'u':							\
-		indirect(op->dst.u, uint32_t)				\
-			= cop val(op->src1, op->src1_type, uint32_t);	\
-		break;							\
-	case 'i':							\
-		indirect(op->dst.u, int32_t)				\
-			= cop val(op->src1, op->src1_type, int32_t);	\
-		break;							\
-	case 'h':							\
-		indirect(op->dst.u, uint16_t)				\
-			= cop val(op->src1, op->src1_type, uint16_t);	\
-		break;							\
-	case 's':							\
-		indirect(op->dst.u, int16_t)				\
-			= cop val(op->src1, op->src1_type, int16_t);	\
-		break;							\
-	case 'c':							\
-		indirect(op->dst.u, uint8_t)				\
-			= cop val(op->src1, op->src1_type, uint8_t);	\
-		break;							\
-	case 'b':							\
-		indirect(op->dst.u, int8_t)				\
-			= cop val(op->src1, op->src1_type, int8_t);	\
-		break;							\
-	}								\
-} while (0)
-
-#define binary_op(op, cop)						\
-do {									\
-	switch (op->dst_type) {						\
-	case 'U':							\
-		op->dst.u = val(op->src1, op->src1_type, uint32_t)	\
-			    cop val(op->src2, op->src2_type, uint32_t); \
-		break;							\
-	case 'I':							\
-		op->dst.i = val(op->src1, op->src1_type, int32_t)	\
-			    cop val(op->src2, op->src2_type, int32_t);	\
-		break;							\
-	case 'F':							\
-		op->dst.f = val(op->src1, op->src1_type, float)		\
-			    cop val(op->src2, op->src2_type, float);	\
-		break;							\
-	case 'z':							\
-		indirect(op->dst.u, uint64_t)				\
-			= val(op->src1, op->src1_type, uint64_t)	\
-			  cop val(op->src2, op->src2_type, uint64_t);	\
-		break;							\
-	case 'l':							\
-		indirect(op->dst.u, int64_t)				\
-			= val(op->src1, op->src1_type, int64_t)		\
-			  cop val(op->src2, op->src2_type, int64_t);	\
-		break;							\
-	case 'd':							\
-		indirect(op->dst.u, double)				\
-			= val(op->src1, op->src1_type, double)		\
-			  cop val(op->src2, op->src2_type, double);	\
-		break;							\
-	case 'u':							\
-		indirect(op->dst.u, uint32_t)				\
-			= val(op->src1, op->src1_type, uint32_t)	\
-			  cop val(op->src2, op->src2_type, uint32_t);	\
-		break;							\
-	case 'i':							\
-		indirect(op->dst.u, int32_t)				\
-			= val(op->src1, op->src1_type, int32_t)		\
-			  cop val(op->src2, op->src2_type, int32_t);	\
-		break;							\
-	case 'f':							\
-		indirect(op->dst.u, float)				\
-			= val(op->src1, op->src1_type, float)		\
-			  cop val(op->src2, op->src2_type, float);	\
-		break;							\
-	case 'h':							\
-		indirect(op->dst.u, uint16_t)				\
-			= val(op->src1, op->src1_type, uint16_t)	\
-			  cop val(op->src2, op->src2_type, uint16_t);	\
-		break;							\
-	case 's':							\
-		indirect(op->dst.u, int16_t)				\
-			= val(op->src1, op->src1_type, int16_t)		\
-			  cop val(op->src2, op->src2_type, int16_t);	\
-		break;							\
-	case 'c':							\
-		indirect(op->dst.u, uint8_t)				\
-			= val(op->src1, op->src1_type, uint8_t)		\
-			  cop val(op->src2, op->src2_type, uint8_t);	\
-		break;							\
-	case 'b':							\
-		indirect(op->dst.u, int8_t)				\
-			= val(op->src1, op->src1_type, int8_t)		\
-			  cop val(op->src2, op->src2_type, int8_t);	\
-		break;							\
-	}								\
-} while (0)
-
-#define binary_op_nofloat(op, cop)					\
-do {									\
-	switch (op->dst_type) {						\
-	case 'U':							\
-		op->dst.u = val(op->src1, op->src1_type, uint32_t)	\
-			    cop val(op->src2, op->src2_type, uint32_t); \
-		break;							\
-	case 'I':							\
-		op->dst.i = val(op->src1, op->src1_type, int32_t)	\
-			    cop val(op->src2, op->src2_type, int32_t);	\
-		break;							\
-	case 'z':							\
-		indirect(op->dst.u, uint64_t)				\
-			= val(op->src1, op->src1_type, uint64_t)	\
-			  cop val(op->src2, op->src2_type, uint64_t);	\
-		break;							\
-	case 'l':							\
-		indirect(op->dst.u, int64_t)				\
-			= val(op->src1, op->src1_type, int64_t)		\
-			  cop val(op->src2, op->src2_type, int64_t);	\
-		break;							\
-	case 'u':							\
-		indirect(op->dst.u, uint32_t)				\
-			= val(op->src1, op->src1_type, uint32_t)	\
-			  cop val(op->src2, op->src2_type, uint32_t);	\
-		break;							\
-	case 'i':							\
-		indirect(op->dst.u, int32_t)				\
-			= val(op->src1, op->src1_type, int32_t)		\
-			  cop val(op->src2, op->src2_type, int32_t);	\
-		break;							\
-	case 'h':							\
-		indirect(op->dst.u, uint16_t)				\
-			= val(op->src1, op->src1_type, uint16_t)	\
-			  cop val(op->src2, op->src2_type, uint16_t);	\
-		break;							\
-	case 's':							\
-		indirect(op->dst.u, int16_t)				\
-			= val(op->src1, op->src1_type, int16_t)		\
-			  cop val(op->src2, op->src2_type, int16_t);	\
-		break;							\
-	case 'c':							\
-		indirect(op->dst.u, uint8_t)				\
-			= val(op->src1, op->src1_type, uint8_t)		\
-			  cop val(op->src2, op->src2_type, uint8_t);	\
-		break;							\
-	case 'b':							\
-		indirect(op->dst.u, int8_t)				\
-			= val(op->src1, op->src1_type, int8_t)		\
-			  cop val(op->src2, op->src2_type, int8_t);	\
-		break;							\
-	}								\
-} while (0)
-
-/* display update routines */
-
 #define debug_printop(i) do {						\
 	int j;								\
 	wprintw(debugscr, "%.4s", addr2caddr(i));			\
@@ -500,17 +92,19 @@ do {									\
 } while (0)
 
 
-static void update_debugscr() {
+static void update_debugscr(nevm *vm) {
+	char *mem;
 	uint32_t i;
 	int row;
+	mem = nevm_mem(vm);
 	werase(debugscr);
-	for (i = 0, row = 0; i < machine.brk && row < getmaxy(debugscr);
+	for (i = 0, row = 0; i < nevm_brk(vm) && row < getmaxy(debugscr);
 	     row++) {
 		mvwprintw(debugscr, row, 0, "0x%03x: ", i);
-		if (i % 16 == 0 && is_op(indirect(i, char))
-		    && is_arg_type(indirect(i + 1, char))
-		    && is_arg_type(indirect(i + 2, char))
-		    && is_arg_type(indirect(i + 3, char))) {
+		if (i % 16 == 0 && nevm_is_op(indirect(i, char))
+		    && nevm_is_arg_type(indirect(i + 1, char))
+		    && nevm_is_arg_type(indirect(i + 2, char))
+		    && nevm_is_arg_type(indirect(i + 3, char))) {
 			debug_printop(i);
 	    	} else {
  		       debug_printword(i);
@@ -519,208 +113,164 @@ static void update_debugscr() {
 	wrefresh(debugscr);
 }
 
-static void update_screen() {
+static void update_screen(nevm *vm) {
+	char *mem;
+	uint32_t dirty;
 	int i;
-	werase(machine.screen);
+	dirty = nevm_take_dirty(vm);
+	if (dirty == 0) {
+		return;
+	}
+	mem = nevm_mem(vm);
+	/* only redraw the rows which have been written */
 	for (i = 0; i < SCREEN_ROWS; i++) {
-		mvwaddnstr(machine.screen, i, 0,
-			   addr2caddr(SCREEN_START + i*SCREEN_COLS),
-			   SCREEN_COLS);
+		if (dirty & (UINT32_C(1) << i)) {
+			wmove(screen, i, 0);
+			wclrtoeol(screen);
+			waddnstr(screen,
+				 addr2caddr(SCREEN_START + i*SCREEN_COLS),
+				 SCREEN_COLS);
+		}
 	}
-	wrefresh(machine.screen);
+	wrefresh(screen);
 }
 
+/* snapshots on request */
 
-/* the VM run loop */
-
-static void run() {
-	operation *op;
-	uint32_t ip;
-	int r;
-	for (;;) {
-		/* update screens */
-		if (debugscr != NULL) {
-			update_debugscr();
-		}
-		update_screen();
+static volatile sig_atomic_t snapshot_requested = 0;
 
-		/* delay, if specified */
-		nanosleep(&config.delay, NULL);
-
-		/* read the IP */
-		ip = indirect(0, uint32_t);
+static void request_snapshot(int sig) {
+	(void) sig;
+	snapshot_requested = 1;
+}
 
-		/* check that the IP is pointing to existing memory */
-		r = check_brk(ip + sizeof(operation));
-		if (r != 0) {
-			fatal("Invalid IP: 0x%x\n", ip);
-		}
-		/* read the operation */
-		op = (operation *) (machine.mem + ip);
-		/* validate the operation and its arguments */
-		validate_op(op->op, caddr2addr(&op->op));
-		validate_arg(op->dst.u, op->dst_type,
-			     caddr2addr(&op->dst.u),
-			     caddr2addr(&op->dst_type));
-		validate_arg(op->src1.u, op->src1_type,
-			     caddr2addr(&op->src1.u),
-			     caddr2addr(&op->src1_type));
-		validate_arg(op->src2.u, op->src2_type,
-			     caddr2addr(&op->src2.u),
-			     caddr2addr(&op->src2_type));
-		/* op-specific validation */
-		switch (op->op) {
-		case '@':
-			assert_brk(valaddr(op->dst, op->dst_type)
-				   + valsize(op->dst_type)
-				     * val(op->src2, op->src2_type, uint32_t),
-				   caddr2addr(&op->dst.u));
-			assert_brk(valaddr(op->src1, op->src1_type)
-				   + valsize(op->dst_type)
-				     * val(op->src2, op->src2_type, uint32_t),
-				   caddr2addr(&op->src1.u));
-			break;
-		case '!':
-		case '&':
-		case '|':
-		case '^':
-		case '<':
-		case '>':
-			if (op->dst_type == 'F'
-			    || op->dst_type == 'f'
-			    || op->dst_type == 'd') {
-				fatal("0x%x:Invalid type at 0x%x: %c. Floating"
-				      " type cannot be used with bitwise"
-				      " operator %c\n",
-				      ip, caddr2addr(&op->dst_type),
-				      op->dst_type, op->op);
-			}
-			break;
-		}
-		/* advance the IP */
-		indirect(0, uint32_t) = ip + sizeof(operation);
-		/* perform the operation */
-		switch (op->op) {
-		case '_':
-			/* No-op */
-			break;
-		case '=':
-			/* Assign */
-			unary_op(op, +);
-			break;
-		case '@':
-			memmove(addr2caddr(valaddr(op->dst, op->dst_type)),
-				addr2caddr(valaddr(op->src1, op->src1_type)),
-				valsize(op->dst_type)
-				  * val(op->src2, op->src2_type, uint32_t));
-			break;
-		case '!':
-			unary_op_nofloat(op, ~);
-			break;
-		case '&':
-			binary_op_nofloat(op, &);
-			break;
-		case '|':
-			binary_op_nofloat(op, |);
-			break;
-		case '^':
-			binary_op_nofloat(op, ^);
-			break;
-		case '<':
-			binary_op_nofloat(op, <<);
-			break;
-		case '>':
-			binary_op_nofloat(op, >>);
-			break;
-		case '~':
-			unary_op(op, -);
-			break;
-		case '+':
-			binary_op(op, +);
-			break;
-		case '-':
-			binary_op(op, -);
-			break;
-		case '*':
-			binary_op(op, *);
-			break;
-		case '/':
-			binary_op(op, /);
-			break;
-		case '%':
-			switch (op->dst_type) {
-			case 'F':
-				op->dst.f
-				  = fmodf(val(op->src1, op->src1_type, float),
-					  val(op->src2, op->src2_type, float));
-				break;
-			case 'f':
-				indirect(op->dst.u, float)
-				  = fmodf(val(op->src1, op->src1_type, float),
-					  val(op->src2, op->src2_type, float));
-				break;
-			case 'd':
-				indirect(op->dst.u, double)
-				  = fmod(val(op->src1, op->src1_type, double),
-					 val(op->src2, op->src2_type, double));
-				break;
-			default:
-				binary_op_nofloat(op, %);
-				break;
-			}
-			break;
-		case '#':
-			return;
+/* called by the machine whenever a frame is due */
+static void frame(nevm *vm, void *arg) {
+	(void) arg;
+	if (snapshot_requested) {
+		snapshot_requested = 0;
+		if (nevm_write_snapshot(vm, options.snapshot) != 0) {
+			fatal("%s", nevm_error(vm));
 		}
 	}
+	if (screen == NULL) {
+		return;
+	}
+	if (debugscr != NULL) {
+		update_debugscr(vm);
+	}
+	update_screen(vm);
+}
+
+static void finish_trace() {
+	if (nevm_trace_close() != 0) {
+		fprintf(stderr, "Couldn't write trace \"%s\": %s\n",
+			options.trace, strerror(errno));
+	}
 }
 
 /* arguments and file loading */
 
 static void usage() {
-	fatal("%s [-d delay] [-g] [-l location] file [[-l location] file] ...\n",
-	      argv0);
+	fatal("%s [-b] [-c snapshot] [-d delay] [-D device] [-g] [-i]"
+	      " [-m limit] [-n steps] [-o] [-p profile] [-r rate] [-s] [-t trace]"
+	      " [-u] [-w snapshot] [-l location] file"
+	      " [[-l location] file] ...\n", argv0);
 }
 
-#define FILE_CHUNK 4096
-
-static void load_file(uint32_t *mem_cursor, char *filename) {
-	FILE *f;
-	size_t r;
-	fprintf(stderr, "Loading %s at %u\n", filename, *mem_cursor);
-	f = fopen(filename, "r");
-	if (f == NULL) {
-		fatal("Couldn't open file \"%s\": %s\n",
-		      filename, strerror(errno));
-	}
-	for (;;) {
-		if (check_brk(*mem_cursor + FILE_CHUNK) != 0) {
-			fatal("Could not create memory for file \"%s\" at %u\n",
-			      filename, *mem_cursor + FILE_CHUNK);
-		}
-		r = fread(addr2caddr(*mem_cursor), 1, FILE_CHUNK, f);
-		*mem_cursor += r;
-		if (r != FILE_CHUNK) {
-			if (feof(f)) {
-				fclose(f);
-				return;
-			} else if (ferror(f)) {
-				fatal("Couldn't read from file \"%s\": %s\n",
-				      filename, strerror(errno));
+/* whether the len bytes at kind are name */
+static bool is_kind(const char *kind, size_t len, const char *name) {
+	return strlen(name) == len && strncmp(kind, name, len) == 0;
+}
+
+/* add the device described by spec, as given to -D: a kind, "@", an
+ * address, and for some kinds ":" and one more argument */
+static void add_device(nevm *vm, const char *spec) {
+	const char *at, *arg;
+	char *end;
+	unsigned long addr, len;
+	size_t kind;
+	int fd, r;
+	at = strchr(spec, '@');
+	if (at == NULL) {
+		fatal("Invalid device \"%s\"\n", spec);
+	}
+	kind = at - spec;
+	addr = strtoul(at + 1, &end, 0);
+	if (end == at + 1 || addr > UINT32_MAX
+	    || (*end != '\0' && *end != ':')) {
+		fatal("Invalid device \"%s\"\n", spec);
+	}
+	arg = *end == ':' ? end + 1 : NULL;
+	if (is_kind(spec, kind, "clock") && arg == NULL) {
+		r = nevm_add_clock(vm, addr);
+	} else if (is_kind(spec, kind, "in") || is_kind(spec, kind, "out")) {
+		len = STREAM_DEFAULT_LEN;
+		if (arg != NULL) {
+			len = strtoul(arg, &end, 0);
+			if (*end != '\0' || len > UINT32_MAX) {
+				fatal("Invalid device \"%s\"\n", spec);
 			}
 		}
+		r = spec[0] == 'i'
+		    ? nevm_add_input(vm, addr, len, STDIN_FILENO)
+		    : nevm_add_output_file(vm, addr, len, stdout);
+	} else if (is_kind(spec, kind, "disk") && arg != NULL) {
+		fd = open(arg, O_RDWR | O_CREAT, 0666);
+		if (fd < 0) {
+			fatal("Couldn't open file \"%s\": %s\n",
+			      arg, strerror(errno));
+		}
+		r = nevm_add_disk(vm, addr, fd);
+	} else {
+		fatal("Invalid device \"%s\"\n", spec);
+	}
+	if (r != 0) {
+		fatal("%s", nevm_error(vm));
 	}
 }
 
+/* load the map neasm wrote alongside filename, if there is one */
+static void load_map(char *filename, uint32_t base, uint32_t len) {
+	char *mapfile;
+	mapfile = malloc(strlen(filename) + sizeof(".map"));
+	if (mapfile == NULL) {
+		fatal("Could not allocate memory for map name\n");
+	}
+	sprintf(mapfile, "%s.map", filename);
+	if (nevm_load_map(mapfile, base, len) != 0 && errno != ENOENT) {
+		fatal("Couldn't load map \"%s\": %s\n",
+		      mapfile, strerror(errno));
+	}
+	free(mapfile);
+}
+
 int main(int argc, char **argv) {
-	uint32_t mem_cursor = 0;
-	bool delay_set = false, debug = false;
-	double delay, delay_f;
+	nevm_config config;
+	nevm *vm;
+	nevm_stop stop;
+	struct load *loads;
+	char **devices;
+	size_t nloads = 0, ndevices = 0, i;
+	uint32_t mem_cursor = 0, start, location = 0;
+	bool delay_set = false, debug = false, located = false;
+	double delay, delay_f, rate;
+	unsigned long long limit, max_steps = 0;
+	char *end;
+	FILE *profile = NULL;
+
+	nevm_config_default(&config);
+	loads = malloc(argc * sizeof(struct load));
+	devices = malloc(argc * sizeof(char *));
+	if (loads == NULL || devices == NULL) {
+		fatal("Could not allocate memory for arguments\n");
+	}
 
-	/* parse arguments and load files */
+	/* parse arguments */
 	ARGBEGIN {
 	case 'l':
-		mem_cursor = atoi(EARGF(usage()));
+		location = atoi(EARGF(usage()));
+		located = true;
 		break;
 	case 'd':
 		/* set delay */
@@ -731,54 +281,250 @@ int main(int argc, char **argv) {
 			= (typeof(config.delay.tv_nsec))(delay_f*1000000000.0f);
 		delay_set = true;
 		break;
+	case 'D':
+		/* add a device */
+		devices[ndevices++] = EARGF(usage());
+		break;
 	case 'g':
 		/* enter debugging mode */
 		debug = true;
 		break;
+	case 'b':
+		/* run without a terminal */
+		options.headless = true;
+		break;
+	case 'm':
+		/* set the limit on memory */
+		limit = strtoull(EARGF(usage()), &end, 0);
+		switch (*end) {
+		case 'g':
+		case 'G':
+			limit <<= 10;
+			/* fall through */
+		case 'm':
+		case 'M':
+			limit <<= 10;
+			/* fall through */
+		case 'k':
+		case 'K':
+			limit <<= 10;
+			end++;
+			break;
+		}
+		if (*end != '\0' || limit == 0) {
+			usage();
+		}
+		config.brk_max = limit > UINT32_MAX
+				 ? UINT32_MAX : (uint32_t) limit;
+		break;
+	case 'n':
+		/* stop after so many operations */
+		max_steps = strtoull(EARGF(usage()), &end, 0);
+		if (*end != '\0' || max_steps == 0) {
+			usage();
+		}
+		break;
+	case 'o':
+		/* run as a console, with the screen as an output stream */
+		options.headless = true;
+		options.console = true;
+		break;
+	case 'p':
+		/* profile the run */
+		options.profile = EARGF(usage());
+		config.profile = true;
+		break;
+	case 't':
+		/* trace the run */
+		options.trace = EARGF(usage());
+		config.trace = true;
+		break;
+	case 'c':
+		/* continue from a snapshot */
+		loads[nloads].filename = EARGF(usage());
+		loads[nloads].snapshot = true;
+		loads[nloads].located = false;
+		nloads++;
+		break;
+	case 'w':
+		/* write a snapshot at halt, or when asked */
+		options.snapshot = EARGF(usage());
+		break;
+	case 'u':
+		/* leave range checks to guard pages */
+		config.guard = true;
+		break;
+	case 'i':
+		/* interpret only, without compiling to native code */
+		config.jit = false;
+		break;
+	case 's':
+		/* print statistics on exit */
+		options.stats = true;
+		break;
+	case 'r':
+		/* set the frame rate */
+		rate = atof(EARGF(usage()));
+		if (rate <= 0) {
+			usage();
+		}
+		delay_f = modf(1.0 / rate, &delay);
+		config.frame.tv_sec
+			= (typeof(config.frame.tv_sec))delay;
+		config.frame.tv_nsec
+			= (typeof(config.frame.tv_nsec))(delay_f*1000000000.0f);
+		break;
 	default:
 		usage();
 	ARG:
-		load_file(&mem_cursor, argv[0]);
+		loads[nloads].filename = argv[0];
+		loads[nloads].snapshot = false;
+		loads[nloads].located = located;
+		loads[nloads].location = location;
+		nloads++;
+		located = false;
 	} ARGEND;
 
-	if (machine.brk == 0) {
+	if (nloads == 0) {
+		/* nothing to load */
+		usage();
+	}
+	if (debug && !delay_set) {
+		/* set delay time */
+		config.delay.tv_sec = DEBUG_DEFAULT_WAIT;
+	}
+	if (!options.headless || options.snapshot != NULL) {
+		config.frame_fn = frame;
+	}
+
+	/* load files */
+	vm = nevm_new(&config);
+	if (vm == NULL) {
+		fatal("Could not allocate memory for the machine\n");
+	}
+	for (i = 0; i < nloads; i++) {
+		if (loads[i].snapshot) {
+			fprintf(stderr, "Restoring %s\n", loads[i].filename);
+			if (nevm_restore_snapshot(vm, loads[i].filename)
+			    != 0) {
+				fatal("%s", nevm_error(vm));
+			}
+			continue;
+		}
+		if (loads[i].located) {
+			mem_cursor = loads[i].location;
+		}
+		start = mem_cursor;
+		fprintf(stderr, "Loading %s at %u\n",
+			loads[i].filename, mem_cursor);
+		if (nevm_load_file(vm, &mem_cursor, loads[i].filename) != 0) {
+			fatal("%s", nevm_error(vm));
+		}
+		load_map(loads[i].filename, start, mem_cursor - start);
+	}
+	free(loads);
+	if (nevm_brk(vm) == 0) {
 		/* nothing was loaded */
 		usage();
 	}
+	if (options.console
+	    && nevm_add_output_file(vm, SCREEN_START, SCREEN_LEN, stdout)
+	       != 0) {
+		fatal("%s", nevm_error(vm));
+	}
+	for (i = 0; i < ndevices; i++) {
+		add_device(vm, devices[i]);
+	}
+	free(devices);
 
-	/* initialize curses */
-	initscr(); curs_set(0); cbreak(); noecho(); clear();
-	machine.screen = stdscr;
-	debugscr = NULL;
-	/* set up debugging */
-	if (debug) {
-		/* set delay time */
-		if (!delay_set) {
-			config.delay.tv_sec = DEBUG_DEFAULT_WAIT;
+	if (options.trace != NULL) {
+		if (nevm_trace_open(options.trace) != 0) {
+			fatal("Couldn't open file \"%s\": %s\n",
+			      options.trace, strerror(errno));
 		}
-		/* split into two windows, if possible */
-		if (getmaxx(stdscr) > SCREEN_COLS + DEBUG_SCREEN_COLS) {
+		/* finish the trace however the machine stops */
+		atexit(finish_trace);
+	}
+	if (options.snapshot != NULL) {
+		signal(SIGUSR1, request_snapshot);
+	}
+	if (options.profile != NULL) {
+		profile = fopen(options.profile, "w");
+		if (profile == NULL) {
+			fatal("Couldn't open file \"%s\": %s\n",
+			      options.profile, strerror(errno));
+		}
+	}
+
+	if (!options.headless) {
+		/* initialize curses */
+		initscr(); curs_set(0); cbreak(); noecho(); clear();
+		screen = stdscr;
+		debugscr = NULL;
+		/* split into two windows for debugging, if possible */
+		if (debug
+		    && getmaxx(stdscr) > SCREEN_COLS + DEBUG_SCREEN_COLS) {
 			/* vertical windows */
-			machine.screen = newwin(getmaxy(stdscr), SCREEN_COLS,
-						0, 0);
+			screen = newwin(getmaxy(stdscr), SCREEN_COLS, 0, 0);
 			debugscr = newwin(getmaxy(stdscr),
 					  DEBUG_SCREEN_COLS, 0,
 					  getmaxx(stdscr) - DEBUG_SCREEN_COLS);
-		} else if (getmaxy(stdscr) > SCREEN_ROWS) {
+		} else if (debug && getmaxy(stdscr) > SCREEN_ROWS) {
 			/* horizontal windows */
-			machine.screen = newwin(SCREEN_ROWS, getmaxx(stdscr),
-						0, 0);
+			screen = newwin(SCREEN_ROWS, getmaxx(stdscr), 0, 0);
 			debugscr = newwin(getmaxy(stdscr) - SCREEN_ROWS - 1,
 					  getmaxx(stdscr),
 					  SCREEN_ROWS + 1, 0);
 		}
 	}
+
 	/* run the vm */
-	run();
-	/* wait for a key press */
-	wgetch(machine.screen);
-	/* tear down curses */
-	endwin();
+	stop = nevm_run(vm, max_steps);
+	if (stop == NEVM_FAILED) {
+		fatal("%s", nevm_error(vm));
+	}
+	if (stop == NEVM_PAUSED) {
+		/* show the screen as it was left */
+		frame(vm, NULL);
+	}
+	if (options.snapshot != NULL
+	    && nevm_write_snapshot(vm, options.snapshot) != 0) {
+		fatal("%s", nevm_error(vm));
+	}
+	if (options.console) {
+		/* the output has all been put in stdout's buffer */
+		if (fflush(stdout) != 0) {
+			fatal("Couldn't write to stdout: %s\n",
+			      strerror(errno));
+		}
+	} else if (options.headless) {
+		/* print the screen, for running without a terminal */
+		nevm_print_screen(nevm_mem(vm) + SCREEN_START, stdout);
+		fflush(stdout);
+	} else {
+		/* wait for a key press */
+		wgetch(screen);
+		/* tear down curses */
+		endwin();
+		screen = NULL;
+	}
+	if (profile != NULL) {
+		if (nevm_write_profile(vm, profile) != 0) {
+			fatal("%s", nevm_error(vm));
+		}
+		if (fclose(profile) != 0) {
+			fatal("Couldn't write profile \"%s\": %s\n",
+			      options.profile, strerror(errno));
+		}
+	}
+	if (stop == NEVM_PAUSED) {
+		fprintf(stderr, "Stopped after %" PRIu64 " operations\n",
+			nevm_steps(vm));
+	}
+	if (options.stats) {
+		nevm_print_stats(vm, stderr);
+	}
+	nevm_free(vm);
 
 	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,250 @@
+/****************************************************************************
+ * ops.c type-specialized operation handlers for nevm                       *
+ *                                                                          *
+ * The handlers are generated by the preprocessor, one for each legal       *
+ * combination of operation and argument types. Immediate types share the   *
+ * handlers of the indirect types with the same C type, leaving ten types   *
+ * per argument. Unary operations don't read their second source, so they  *
+ * are specialized on the destination and first source only. Bitwise        *
+ * operations don't allow floating point destinations.                      *
+ *                                                                          *
+ * As in the rest of nevm, all values are first cast to the destination's   *
+ * C type, then combined using the underlying C operator.                   *
+ ****************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include "ops.h"
+
+/* indices of the C types */
+enum {
+	T_z, T_l, T_d, T_u, T_i, T_f, T_h, T_s, T_c, T_b, T_N
+};
+
+/* The lists of types, each of which calls X(type, ctype, ...) for every
+ * type. There is one list per argument, as a macro may not expand itself. */
+
+#define DST_TYPES(X, ...)						\
+	X(z, uint64_t, __VA_ARGS__) X(l, int64_t, __VA_ARGS__)		\
+	X(d, double, __VA_ARGS__) DST_INT_TYPES_32(X, __VA_ARGS__)	\
+	X(f, float, __VA_ARGS__) DST_INT_TYPES_16(X, __VA_ARGS__)
+
+#define DST_INT_TYPES(X, ...)						\
+	X(z, uint64_t, __VA_ARGS__) X(l, int64_t, __VA_ARGS__)		\
+	DST_INT_TYPES_32(X, __VA_ARGS__) DST_INT_TYPES_16(X, __VA_ARGS__)
+
+#define DST_INT_TYPES_32(X, ...)					\
+	X(u, uint32_t, __VA_ARGS__) X(i, int32_t, __VA_ARGS__)
+
+#define DST_INT_TYPES_16(X, ...)					\
+	X(h, uint16_t, __VA_ARGS__) X(s, int16_t, __VA_ARGS__)		\
+	X(c, uint8_t, __VA_ARGS__) X(b, int8_t, __VA_ARGS__)
+
+#define SRC1_TYPES(X, ...)						\
+	X(z, uint64_t, __VA_ARGS__) X(l, int64_t, __VA_ARGS__)		\
+	X(d, double, __VA_ARGS__) X(u, uint32_t, __VA_ARGS__)		\
+	X(i, int32_t, __VA_ARGS__) X(f, float, __VA_ARGS__)		\
+	X(h, uint16_t, __VA_ARGS__) X(s, int16_t, __VA_ARGS__)		\
+	X(c, uint8_t, __VA_ARGS__) X(b, int8_t, __VA_ARGS__)
+
+#define SRC2_TYPES(X, ...)						\
+	X(z, uint64_t, __VA_ARGS__) X(l, int64_t, __VA_ARGS__)		\
+	X(d, double, __VA_ARGS__) X(u, uint32_t, __VA_ARGS__)		\
+	X(i, int32_t, __VA_ARGS__) X(f, float, __VA_ARGS__)		\
+	X(h, uint16_t, __VA_ARGS__) X(s, int16_t, __VA_ARGS__)		\
+	X(c, uint8_t, __VA_ARGS__) X(b, int8_t, __VA_ARGS__)
+
+#define at(addr, ctype)							\
+	(*((ctype *) (mem + (addr))))
+
+
+/* unary operations */
+
+#define UNARY_HANDLER(s1, s1ctype, name, cop, dt, dctype)		\
+static void name##_##dt##s1(char *mem, const decoded *d) {		\
+	at(d->dst, dctype) = cop (dctype) at(d->src1, s1ctype);		\
+}
+
+#define UNARY_HANDLERS(dt, dctype, name, cop)				\
+	SRC1_TYPES(UNARY_HANDLER, name, cop, dt, dctype)
+
+#define UNARY_ENTRY(s1, s1ctype, name, dt)				\
+	[T_##s1] = name##_##dt##s1,
+
+#define UNARY_ENTRIES(dt, dctype, name)					\
+	[T_##dt] = { SRC1_TYPES(UNARY_ENTRY, name, dt) },
+
+DST_TYPES(UNARY_HANDLERS, assign, +)
+DST_TYPES(UNARY_HANDLERS, neg, -)
+DST_INT_TYPES(UNARY_HANDLERS, not, ~)
+
+static const op_handler assign_handlers[T_N][T_N] = {
+	DST_TYPES(UNARY_ENTRIES, assign)
+};
+
+static const op_handler neg_handlers[T_N][T_N] = {
+	DST_TYPES(UNARY_ENTRIES, neg)
+};
+
+static const op_handler not_handlers[T_N][T_N] = {
+	DST_INT_TYPES(UNARY_ENTRIES, not)
+};
+
+
+/* binary operations */
+
+#define BINARY_HANDLER(s2, s2ctype, name, cop, dt, dctype, s1, s1ctype)	\
+static void name##_##dt##s1##s2(char *mem, const decoded *d) {		\
+	at(d->dst, dctype) = (dctype) at(d->src1, s1ctype)		\
+			     cop (dctype) at(d->src2, s2ctype);		\
+}
+
+#define FUNC_HANDLER(s2, s2ctype, name, func, dt, dctype, s1, s1ctype)	\
+static void name##_##dt##s1##s2(char *mem, const decoded *d) {		\
+	at(d->dst, dctype) = func((dctype) at(d->src1, s1ctype),	\
+				  (dctype) at(d->src2, s2ctype));	\
+}
+
+#define BINARY_HANDLERS_2(s1, s1ctype, name, cop, dt, dctype)		\
+	SRC2_TYPES(BINARY_HANDLER, name, cop, dt, dctype, s1, s1ctype)
+
+#define BINARY_HANDLERS(dt, dctype, name, cop)				\
+	SRC1_TYPES(BINARY_HANDLERS_2, name, cop, dt, dctype)
+
+#define FUNC_HANDLERS_2(s1, s1ctype, name, func, dt, dctype)		\
+	SRC2_TYPES(FUNC_HANDLER, name, func, dt, dctype, s1, s1ctype)
+
+#define BINARY_ENTRY(s2, s2ctype, name, dt, s1)				\
+	[T_##s2] = name##_##dt##s1##s2,
+
+#define BINARY_ENTRIES_2(s1, s1ctype, name, dt)				\
+	[T_##s1] = { SRC2_TYPES(BINARY_ENTRY, name, dt, s1) },
+
+#define BINARY_ENTRIES(dt, dctype, name)				\
+	[T_##dt] = { SRC1_TYPES(BINARY_ENTRIES_2, name, dt) },
+
+DST_TYPES(BINARY_HANDLERS, add, +)
+DST_TYPES(BINARY_HANDLERS, sub, -)
+DST_TYPES(BINARY_HANDLERS, mul, *)
+DST_TYPES(BINARY_HANDLERS, div, /)
+DST_INT_TYPES(BINARY_HANDLERS, rem, %)
+SRC1_TYPES(FUNC_HANDLERS_2, rem, fmod, d, double)
+SRC1_TYPES(FUNC_HANDLERS_2, rem, fmodf, f, float)
+DST_INT_TYPES(BINARY_HANDLERS, and, &)
+DST_INT_TYPES(BINARY_HANDLERS, or, |)
+DST_INT_TYPES(BINARY_HANDLERS, xor, ^)
+DST_INT_TYPES(BINARY_HANDLERS, shl, <<)
+DST_INT_TYPES(BINARY_HANDLERS, shr, >>)
+
+static const op_handler add_handlers[T_N][T_N][T_N] = {
+	DST_TYPES(BINARY_ENTRIES, add)
+};
+
+static const op_handler sub_handlers[T_N][T_N][T_N] = {
+	DST_TYPES(BINARY_ENTRIES, sub)
+};
+
+static const op_handler mul_handlers[T_N][T_N][T_N] = {
+	DST_TYPES(BINARY_ENTRIES, mul)
+};
+
+static const op_handler div_handlers[T_N][T_N][T_N] = {
+	DST_TYPES(BINARY_ENTRIES, div)
+};
+
+static const op_handler rem_handlers[T_N][T_N][T_N] = {
+	DST_TYPES(BINARY_ENTRIES, rem)
+};
+
+static const op_handler and_handlers[T_N][T_N][T_N] = {
+	DST_INT_TYPES(BINARY_ENTRIES, and)
+};
+
+static const op_handler or_handlers[T_N][T_N][T_N] = {
+	DST_INT_TYPES(BINARY_ENTRIES, or)
+};
+
+static const op_handler xor_handlers[T_N][T_N][T_N] = {
+	DST_INT_TYPES(BINARY_ENTRIES, xor)
+};
+
+static const op_handler shl_handlers[T_N][T_N][T_N] = {
+	DST_INT_TYPES(BINARY_ENTRIES, shl)
+};
+
+static const op_handler shr_handlers[T_N][T_N][T_N] = {
+	DST_INT_TYPES(BINARY_ENTRIES, shr)
+};
+
+
+/* lookup */
+
+static int type_index(char type) {
+	switch (type) {
+	case 'z':
+		return T_z;
+	case 'l':
+		return T_l;
+	case 'd':
+		return T_d;
+	case 'U':
+	case 'u':
+		return T_u;
+	case 'I':
+	case 'i':
+		return T_i;
+	case 'F':
+	case 'f':
+		return T_f;
+	case 'h':
+		return T_h;
+	case 's':
+		return T_s;
+	case 'c':
+		return T_c;
+	case 'b':
+		return T_b;
+	default:
+		return -1;
+	}
+}
+
+op_handler ops_lookup(char op, char dst_type, char src1_type, char src2_type) {
+	int dt, s1, s2;
+	dt = type_index(dst_type);
+	s1 = type_index(src1_type);
+	s2 = type_index(src2_type);
+	if (dt < 0 || s1 < 0 || s2 < 0) {
+		return NULL;
+	}
+	switch (op) {
+	case '=':
+		return assign_handlers[dt][s1];
+	case '~':
+		return neg_handlers[dt][s1];
+	case '!':
+		return not_handlers[dt][s1];
+	case '+':
+		return add_handlers[dt][s1][s2];
+	case '-':
+		return sub_handlers[dt][s1][s2];
+	case '*':
+		return mul_handlers[dt][s1][s2];
+	case '/':
+		return div_handlers[dt][s1][s2];
+	case '%':
+		return rem_handlers[dt][s1][s2];
+	case '&':
+		return and_handlers[dt][s1][s2];
+	case '|':
+		return or_handlers[dt][s1][s2];
+	case '^':
+		return xor_handlers[dt][s1][s2];
+	case '<':
+		return shl_handlers[dt][s1][s2];
+	case '>':
+		return shr_handlers[dt][s1][s2];
+	default:
+		return NULL;
+	}
+}
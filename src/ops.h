@@ -0,0 +1,44 @@
+/****************************************************************************
+ * ops.h type-specialized operation handlers for nevm                       *
+ *                                                                          *
+ * When an operation is decoded, each of its arguments is resolved to the   *
+ * address of its value: for immediate types, the address of the argument   *
+ * within the operation itself, and for indirect types, the argument.       *
+ * Immediate and indirect arguments of the same C type are then read the    *
+ * same way, and a handler specialized for the operation and the C types of *
+ * its arguments can perform it without looking at any of the types again.  *
+ ****************************************************************************/
+#ifndef OPS_H
+#define OPS_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct decoded decoded;
+
+typedef void (*op_handler)(char *mem, const decoded *d);
+
+/* a decoded operation */
+struct decoded {
+	uint32_t ip; /* address of the operation */
+	char op;
+	uint8_t live; /* words of the operation which affect decoding */
+	bool wide; /* whether the write needs more than its slot checked */
+	uint8_t fused; /* operations after this one performed along with it */
+	op_handler exec;
+	const void *target; /* where the run loop jumps to perform it */
+	uint32_t dst; /* address of the destination value */
+	uint32_t src1; /* address of the first source value */
+	uint32_t src2; /* address of the second source value */
+	uint32_t wlen; /* number of bytes written to dst */
+	uint16_t heat; /* times jumped to, to find code worth compiling */
+	uint16_t jit_refs; /* number of compiled blocks including this */
+	struct jit_block *block; /* compiled block starting here, if any */
+};
+
+/* Find the handler for an arithmetic, bitwise, or assignment operation with
+ * the given types. Returns NULL for any other operation, or for a floating
+ * point destination with a bitwise operation. */
+op_handler ops_lookup(char op, char dst_type, char src1_type, char src2_type);
+
+#endif
@@ -0,0 +1,180 @@
+/****************************************************************************
+ * symbols.c source locations for nevm                                      *
+ *                                                                          *
+ * Each map is checked once as it is loaded, so that lookups can trust the *
+ * offsets in it.                                                           *
+ ****************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nemap.h"
+#include "symbols.h"
+
+typedef struct {
+	uint32_t base;
+	uint32_t len;
+	const nemap_header *header;
+	const nemap_symbol *symbols;
+	const nemap_line *lines;
+	const char *strings;
+} map;
+
+static map *maps = NULL;
+static size_t nmaps = 0;
+
+/* check that the map of size bytes at m is consistent */
+static bool check_map(const map *m, size_t size) {
+	const nemap_header *h;
+	size_t tables;
+	uint32_t i;
+	h = m->header;
+	if (size < sizeof(*h)
+	    || memcmp(h->magic, NEMAP_MAGIC, sizeof(h->magic)) != 0
+	    || h->version != NEMAP_VERSION) {
+		return false;
+	}
+	tables = (size_t) h->nsymbols * sizeof(nemap_symbol)
+		 + (size_t) h->nlines * sizeof(nemap_line);
+	if (size - sizeof(*h) < tables
+	    || size - sizeof(*h) - tables != h->strings_len
+	    || h->strings_len == 0
+	    || m->strings[h->strings_len - 1] != '\0') {
+		return false;
+	}
+	for (i = 0; i < h->nsymbols; i++) {
+		if (m->symbols[i].name >= h->strings_len
+		    || (i > 0 && m->symbols[i].addr < m->symbols[i - 1].addr)) {
+			return false;
+		}
+	}
+	for (i = 1; i < h->nlines; i++) {
+		if (m->lines[i].addr < m->lines[i - 1].addr) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int symbols_load(const char *filename, uint32_t base, uint32_t len) {
+	int fd, err;
+	struct stat st;
+	void *mem;
+	map m, *newmaps;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0) {
+		goto error;
+	}
+	if ((size_t) st.st_size < sizeof(nemap_header)) {
+		errno = EINVAL;
+		goto error;
+	}
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mem == MAP_FAILED) {
+		goto error;
+	}
+	close(fd);
+
+	m.base = base;
+	m.len = len;
+	m.header = mem;
+	m.symbols = (const nemap_symbol *) (m.header + 1);
+	m.lines = (const nemap_line *) (m.symbols + m.header->nsymbols);
+	m.strings = (const char *) (m.lines + m.header->nlines);
+	if (!check_map(&m, st.st_size)) {
+		munmap(mem, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	newmaps = realloc(maps, (nmaps + 1) * sizeof(map));
+	if (newmaps == NULL) {
+		munmap(mem, st.st_size);
+		return -1;
+	}
+	maps = newmaps;
+	maps[nmaps++] = m;
+	return 0;
+
+error:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+/* the index of the last symbol at or before addr, or -1 */
+static long find_symbol(const map *m, uint32_t addr) {
+	long lo, hi, mid;
+	lo = 0;
+	hi = m->header->nsymbols;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (m->symbols[mid].addr <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo - 1;
+}
+
+/* the index of the last line at or before addr, or -1 */
+static long find_line(const map *m, uint32_t addr) {
+	long lo, hi, mid;
+	lo = 0;
+	hi = m->header->nlines;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (m->lines[mid].addr <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo - 1;
+}
+
+bool symbols_describe(uint32_t addr, char *buf, size_t len) {
+	const map *m;
+	size_t i;
+	uint32_t rel;
+	long sym, line;
+	int n;
+	/* later images are loaded over earlier ones */
+	for (i = nmaps; i > 0; i--) {
+		m = &maps[i - 1];
+		if (addr >= m->base && addr - m->base < m->len) {
+			break;
+		}
+	}
+	if (i == 0) {
+		return false;
+	}
+	rel = addr - m->base;
+	sym = find_symbol(m, rel);
+	if (sym >= 0) {
+		n = snprintf(buf, len, "%s+0x%x",
+			     m->strings + m->symbols[sym].name,
+			     rel - m->symbols[sym].addr);
+	} else {
+		n = snprintf(buf, len, "0x%x", addr);
+	}
+	line = find_line(m, rel);
+	if (line >= 0 && n >= 0 && (size_t) n < len) {
+		snprintf(buf + n, len - n, " (%s:%u)", m->strings,
+			 m->lines[line].lineno);
+	}
+	return true;
+}
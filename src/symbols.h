@@ -0,0 +1,25 @@
+/****************************************************************************
+ * symbols.h source locations for nevm                                      *
+ *                                                                          *
+ * Maps written by neasm (see nemap.h) are mapped into memory as images are *
+ * loaded, and used to describe addresses in terms of the symbols and lines *
+ * of the source, for profiles, traces, and error messages. Lookups are     *
+ * binary searches of the tables as neasm wrote them.                       *
+ ****************************************************************************/
+#ifndef SYMBOLS_H
+#define SYMBOLS_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Load the map at filename, for an image of len bytes loaded at base.
+ * Returns -1 and sets errno if the map can't be read, or to EINVAL if it
+ * isn't a valid map. */
+int symbols_load(const char *filename, uint32_t base, uint32_t len);
+
+/* Describe addr as "symbol+offset (file:line)" in buf, which holds len
+ * bytes. Returns false, leaving buf alone, if no map covers addr. */
+bool symbols_describe(uint32_t addr, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,198 @@
+/****************************************************************************
+ * trace.c execution traces for nevm                                        *
+ *                                                                          *
+ * The ring buffer has a single producer, the machine, and a single         *
+ * consumer, the writer thread. Each only ever moves its own end of the     *
+ * buffer, so no locks are needed: the machine publishes records by moving  *
+ * the head, and the writer frees space by moving the tail. When the buffer *
+ * is full the machine yields until the writer catches up, since a trace    *
+ * with records missing can't be replayed.                                  *
+ ****************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "trace.h"
+
+#define TRACE_RING (16 * 1024 * 1024)
+#define TRACE_MASK (TRACE_RING - 1)
+#define TRACE_IDLE_NS 100000
+
+static struct {
+	char *ring;
+	atomic_size_t head; /* moved by the machine */
+	atomic_size_t tail; /* moved by the writer */
+	atomic_bool done;
+	FILE *f;
+	int error; /* errno of the first failed write */
+	pthread_t writer;
+	uint32_t last_ip;
+	uint32_t last_write;
+} trace;
+
+static void *trace_writer(void *arg) {
+	size_t head, tail, n;
+	struct timespec idle = { 0, TRACE_IDLE_NS };
+	(void) arg;
+	tail = atomic_load_explicit(&trace.tail, memory_order_relaxed);
+	for (;;) {
+		head = atomic_load_explicit(&trace.head, memory_order_acquire);
+		if (head == tail) {
+			if (atomic_load_explicit(&trace.done,
+						 memory_order_acquire)
+			    && atomic_load_explicit(&trace.head,
+						    memory_order_acquire)
+			       == tail) {
+				return NULL;
+			}
+			nanosleep(&idle, NULL);
+			continue;
+		}
+		/* write up to the head or the end of the buffer */
+		n = head - tail;
+		if (n > TRACE_RING - (tail & TRACE_MASK)) {
+			n = TRACE_RING - (tail & TRACE_MASK);
+		}
+		if (fwrite(trace.ring + (tail & TRACE_MASK), 1, n, trace.f)
+		    != n && trace.error == 0) {
+			trace.error = errno;
+		}
+		tail += n;
+		atomic_store_explicit(&trace.tail, tail, memory_order_release);
+	}
+}
+
+/* copy len bytes into the ring, waiting for space as needed */
+static void put(const void *data, size_t len) {
+	size_t head, tail, n;
+	const char *p;
+	p = data;
+	head = atomic_load_explicit(&trace.head, memory_order_relaxed);
+	while (len > 0) {
+		tail = atomic_load_explicit(&trace.tail, memory_order_acquire);
+		while (head - tail == TRACE_RING) {
+			sched_yield();
+			tail = atomic_load_explicit(&trace.tail,
+						    memory_order_acquire);
+		}
+		n = TRACE_RING - (head - tail);
+		if (n > TRACE_RING - (head & TRACE_MASK)) {
+			n = TRACE_RING - (head & TRACE_MASK);
+		}
+		if (n > len) {
+			n = len;
+		}
+		memcpy(trace.ring + (head & TRACE_MASK), p, n);
+		head += n;
+		p += n;
+		len -= n;
+		atomic_store_explicit(&trace.head, head, memory_order_release);
+	}
+}
+
+/* encode v at buf, returning the number of bytes used */
+static size_t varint(unsigned char *buf, uint64_t v) {
+	size_t n;
+	for (n = 0; v >= 0x80; n++) {
+		buf[n] = (unsigned char) (v | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = (unsigned char) v;
+	return n;
+}
+
+int trace_open(const char *filename) {
+	int err;
+	trace.f = fopen(filename, "w");
+	if (trace.f == NULL) {
+		return -1;
+	}
+	trace.ring = malloc(TRACE_RING);
+	if (trace.ring == NULL) {
+		goto error;
+	}
+	atomic_init(&trace.head, 0);
+	atomic_init(&trace.tail, 0);
+	atomic_init(&trace.done, false);
+	trace.error = 0;
+	trace.last_ip = 0;
+	trace.last_write = 0;
+	put(TRACE_MAGIC, strlen(TRACE_MAGIC));
+	err = pthread_create(&trace.writer, NULL, trace_writer, NULL);
+	if (err != 0) {
+		errno = err;
+		goto error;
+	}
+	return 0;
+
+error:
+	err = errno;
+	free(trace.ring);
+	fclose(trace.f);
+	trace.f = NULL;
+	errno = err;
+	return -1;
+}
+
+void trace_op(uint32_t ip, const char *op) {
+	unsigned char buf[16];
+	size_t n;
+	n = varint(buf, zigzag((int64_t) ip
+			       - ((int64_t) trace.last_ip + 16)) << 2
+			| TRACE_OP);
+	memcpy(buf + n, op, 4);
+	trace.last_ip = ip;
+	put(buf, n + 4);
+}
+
+void trace_write(uint32_t addr, const char *data, uint32_t len) {
+	unsigned char buf[32];
+	size_t n;
+	n = varint(buf, zigzag((int64_t) addr - (int64_t) trace.last_write)
+			<< 2 | TRACE_WRITE);
+	n += varint(buf + n, len);
+	trace.last_write = addr;
+	put(buf, n);
+	put(data, len);
+}
+
+void trace_memory(uint32_t addr, const char *data, uint32_t len) {
+	unsigned char buf[32];
+	size_t n;
+	n = varint(buf, (uint64_t) addr << 2 | TRACE_MEMORY);
+	n += varint(buf + n, len);
+	put(buf, n);
+	put(data, len);
+}
+
+void trace_halt(void) {
+	unsigned char end = TRACE_END;
+	put(&end, 1);
+}
+
+int trace_close(void) {
+	int err;
+	if (trace.f == NULL) {
+		return 0;
+	}
+	atomic_store_explicit(&trace.done, true, memory_order_release);
+	pthread_join(trace.writer, NULL);
+	free(trace.ring);
+	err = trace.error;
+	if (fclose(trace.f) != 0 && err == 0) {
+		err = errno;
+	}
+	trace.f = NULL;
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,61 @@
+/****************************************************************************
+ * trace.h execution traces for nevm                                        *
+ *                                                                          *
+ * A trace records everything needed to replay a run: the memory the       *
+ * machine started with, the address and operation bytes of every          *
+ * operation performed, and every write the operations made. A trace file  *
+ * starts with TRACE_MAGIC, followed by records, each of which starts with  *
+ * a varint whose low two bits are its kind and whose other bits are a     *
+ * value depending on the kind:                                             *
+ *                                                                          *
+ *   TRACE_OP     zigzag(ip - (last ip + 16)), then 4 bytes of operation    *
+ *   TRACE_WRITE  zigzag(addr - last write addr), then varint length, then  *
+ *                the bytes written                                         *
+ *   TRACE_MEMORY addr, then varint length, then the bytes there           *
+ *   TRACE_END    0, if the machine halted                                  *
+ *                                                                          *
+ * Varints are little-endian groups of 7 bits, with the high bit set on all *
+ * but the last. Before each operation, the IP is advanced just as nevm     *
+ * does, so that memory can be reconstructed from the records alone.        *
+ *                                                                          *
+ * Records are encoded into a ring buffer by the machine and written out by *
+ * another thread, so that the machine only waits on the disk when it gets  *
+ * a whole buffer ahead.                                                    *
+ ****************************************************************************/
+#ifndef TRACE_H
+#define TRACE_H 1
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "NETRACE1"
+
+enum {
+	TRACE_OP,
+	TRACE_WRITE,
+	TRACE_MEMORY,
+	TRACE_END
+};
+
+#define zigzag(v) ((uint64_t) (((int64_t) (v) << 1) ^ ((int64_t) (v) >> 63)))
+#define unzigzag(v) ((int64_t) ((v) >> 1) ^ -(int64_t) ((v) & 1))
+
+/* Start tracing to filename. Returns -1 and sets errno on failure. */
+int trace_open(const char *filename);
+
+/* Record the operation at ip, whose first 4 bytes are at op. */
+void trace_op(uint32_t ip, const char *op);
+
+/* Record a write of len bytes, now at data, to addr. */
+void trace_write(uint32_t addr, const char *data, uint32_t len);
+
+/* Record the contents of memory at addr. */
+void trace_memory(uint32_t addr, const char *data, uint32_t len);
+
+/* Record that the machine halted. */
+void trace_halt(void);
+
+/* Finish the trace, waiting for everything to be written. Returns -1 and
+ * sets errno if any of it couldn't be. */
+int trace_close(void);
+
+#endif
@@ -0,0 +1,2926 @@
+/****************************************************************************
+ * vm.c the noneleatic virtual machine                                      *
+ *                                                                          *
+ * This virtual machine follows closely to the spec in doc/machine.txt      *
+ * It makes no effort to make up for big/little endian differences in the   *
+ * underlying machine, and so some programs won't work the same when the VM *
+ * is compiled for a machine of different endianness from the one on which  *
+ * the program was written.                                                 *
+ *                                                                          *
+ * The general run strategy is:                                             *
+ * (1) every so often, service the devices, and tell the caller if a        *
+ *     frame is due                                                         *
+ * (2) look up the decoded opcode at the IP, reading, validating and        *
+ *     decoding it if it isn't cached                                       *
+ * (3) advance IP - it is crucial to advance IP before actually executing   *
+ *     the operation, as this way changes the operation makes to the IP     *
+ *     will be reflected in the next opcode read.                           *
+ * (3) execute opcode using underlying c instruction, first casting all     *
+ *     data types to the opcode's return type.                              *
+ *                                                                          *
+ * The memory is managed as a flat region of address space, reserved for    *
+ * the whole 32-bit address space when it is first needed, so that it       *
+ * never moves. Pages are made accessible as the break grows past them, at  *
+ * least doubling the accessible area each time, so growing the break is    *
+ * cheap and checking an address against it is a single compare. Pages      *
+ * which are accessible but never touched take no memory, so programs may   *
+ * scatter their data widely without paying for the gaps.                   *
+ *                                                                          *
+ * All of the state of a machine is kept in its struct nevm, so that        *
+ * machines on separate threads have nothing to share but the maps in       *
+ * symbols.c, which are only read while machines run.                       *
+ ****************************************************************************/
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <math.h>
+#include "ops.h"
+#include "jit.h"
+#include "symbols.h"
+#include "trace.h"
+#include "nevm.h"
+
+#define FRAME_DEFAULT_RATE 30
+#define DEFAULT_POLL 4096
+#define MAX_DEVICES 32
+#define DCACHE_SIZE 4096
+#define FUSED_SLOTS 256
+#define FUSED_KEEP 2
+#define ERROR_LEN 512
+#define PAGEMAP_CHUNK 512
+#define PAGEMAP_PRESENT (UINT64_C(1) << 63)
+#define PAGEMAP_SWAPPED (UINT64_C(1) << 62)
+#define PAGEMAP_FILE (UINT64_C(1) << 61)
+
+typedef struct {
+	char op;
+	char dst_type;
+	char src1_type;
+	char src2_type;
+	union {
+		uint32_t u;
+		int32_t i;
+		float f;
+	} dst;
+	union {
+		uint32_t u;
+		int32_t i;
+		float f;
+	} src1;
+	union {
+		uint32_t u;
+		int32_t i;
+		float f;
+	} src2;
+} operation;
+
+/* a device, and how to service it */
+struct device {
+	uint32_t start;
+	uint32_t end;
+	bool written; /* since it was last serviced */
+	void (*service)(nevm *vm, struct device *dev);
+	/* for devices of the host's own */
+	nevm_device_fn fn;
+	void *arg;
+	/* for the built in devices */
+	int fd;
+	FILE *file; /* written through instead of fd, if set */
+	struct timespec base;
+};
+
+/* the last few decodings of a slot which a fused sequence rewrites, and
+ * what the slot held when each was made */
+struct fused_slot {
+	uint32_t ip; /* the slot, or DCACHE_EMPTY */
+	uint32_t nkept;
+	uint32_t next; /* which to replace next */
+	operation held[FUSED_KEEP];
+	decoded kept[FUSED_KEEP];
+};
+
+/* a representation of the machine */
+struct nevm {
+	nevm_config config;
+	char *mem;
+	uint32_t brk;
+	size_t reserved; /* bytes of address space reserved at mem */
+	size_t committed; /* bytes at mem which are accessible */
+	bool guarded; /* whether the fault handler is held for this machine */
+	uint32_t dirty; /* screen rows written since the last frame */
+	bool started; /* whether run() has set the machine up */
+	bool running;
+	uint64_t step_limit; /* operations to stop after, if nonzero */
+	decoded dcache[DCACHE_SIZE];
+	decoded uncached; /* for operations which can't be cached */
+	struct fused_slot fused[FUSED_SLOTS];
+	const void *const *dispatch; /* the run loop's jump targets */
+	nevm_stats stats;
+	struct {
+		bool delay;
+		uint32_t poll;
+		struct timespec next;
+	} frames;
+	struct {
+		bool enabled;
+		jit_buffer *code;
+		struct jit_block *blocks;
+		uint32_t nblocks;
+	} jit;
+	struct {
+		/* the smallest range covering the screen and every device,
+		 * outside which writes needn't be looked at */
+		uint32_t start;
+		uint32_t end;
+		struct device devices[MAX_DEVICES];
+		uint32_t ndevices;
+	} io;
+	struct profile *profile;
+	int depth; /* calls into the machine in progress */
+	sigjmp_buf fail; /* where the outermost of them catches failures */
+	char error[ERROR_LEN];
+};
+
+/* the machine running on this thread, for the guard page fault handler */
+static _Thread_local nevm *running_vm = NULL;
+
+/* whether [addr, addr + len) may overlap the screen or a device */
+static inline bool io_overlaps(nevm *vm, uint32_t addr, uint32_t len) {
+	return addr < vm->io.end && addr + len > vm->io.start;
+}
+
+/* note a write to the screen or devices at [addr, addr + len) */
+static void io_written(nevm *vm, uint32_t addr, uint32_t len) {
+	struct device *dev;
+	uint32_t first, last, i;
+	if (addr < SCREEN_END && addr + len > SCREEN_START) {
+		first = addr < SCREEN_START
+			? 0 : (addr - SCREEN_START) / SCREEN_COLS;
+		last = addr + len >= SCREEN_END
+			? SCREEN_ROWS - 1
+			: (addr + len - 1 - SCREEN_START) / SCREEN_COLS;
+		vm->dirty |= ((UINT32_C(1) << (last + 1)) - 1)
+			     & ~((UINT32_C(1) << first) - 1);
+	}
+	for (i = 0; i < vm->io.ndevices; i++) {
+		dev = &vm->io.devices[i];
+		if (addr < dev->end && addr + len > dev->start) {
+			dev->written = true;
+		}
+	}
+}
+
+
+/* failures
+ *
+ * Anything which goes wrong with the machine is fatal to it, but not to
+ * anything else, so rather than exiting, fatal() notes what went wrong and
+ * where the IP was, and jumps back out to the call into the machine which
+ * caught it. Every public function which can fail wraps its work in
+ * enter() and leave(); a failure within nested calls, such as one made
+ * by a frame callback, is caught by the outermost. */
+
+static void fail(nevm *vm, const char *fmt, ...)
+	__attribute__((noreturn, format(printf, 2, 3)));
+
+static void fail(nevm *vm, const char *fmt, ...) {
+	va_list ap;
+	char where[256];
+	uint32_t ip;
+	int n;
+	va_start(ap, fmt);
+	n = vsnprintf(vm->error, sizeof(vm->error), fmt, ap);
+	va_end(ap);
+	if (vm->running) {
+		/* print where in the source the IP is, if a map covers it */
+		ip = *(uint32_t *) vm->mem;
+		if (n >= 0 && (size_t) n < sizeof(vm->error)
+		    && symbols_describe(ip, where, sizeof(where))) {
+			snprintf(vm->error + n, sizeof(vm->error) - n,
+				 "0x%x is %s\n", ip, where);
+		}
+		vm->running = false;
+		clock_gettime(CLOCK_MONOTONIC, &vm->stats.end);
+		running_vm = NULL;
+	}
+	siglongjmp(vm->fail, 1);
+}
+
+#define fatal(...) fail(vm, __VA_ARGS__)
+
+#define enter(vm) do {							\
+	if ((vm)->depth++ == 0) {					\
+		if (sigsetjmp((vm)->fail, 1) != 0) {			\
+			(vm)->depth = 0;				\
+			return -1;					\
+		}							\
+	}								\
+} while (0)
+
+#define leave(vm) ((vm)->depth--)
+
+/* memory translation and addressing */
+
+#define caddr2addr(caddr)						\
+	 ((uint32_t) (((char *) (caddr)) - vm->mem))
+
+#define addr2caddr(addr)						\
+	 (vm->mem + (addr))
+
+#define indirect(addr, ctype)						\
+	(*((ctype *) addr2caddr(addr)))
+
+#define valaddr(arg, type)						\
+	(  (type) == 'U' ? caddr2addr(&(arg).u)				\
+	 : (type) == 'I' ? caddr2addr(&(arg).u)				\
+	 : (type) == 'F' ? caddr2addr(&(arg).u)				\
+	 : (arg).u)
+
+#define valsize(type)							\
+	(  (type) == 'U' ? (uint32_t) 4					\
+	 : (type) == 'I' ? (uint32_t) 4					\
+	 : (type) == 'F' ? (uint32_t) 4					\
+	 : (type) == 'z' ? (uint32_t) 8					\
+	 : (type) == 'l' ? (uint32_t) 8					\
+	 : (type) == 'd' ? (uint32_t) 8					\
+	 : (type) == 'u' ? (uint32_t) 4					\
+	 : (type) == 'i' ? (uint32_t) 4					\
+	 : (type) == 'f' ? (uint32_t) 4					\
+	 : (type) == 'h' ? (uint32_t) 2					\
+	 : (type) == 's' ? (uint32_t) 2					\
+	 : (type) == 'c' ? (uint32_t) 1					\
+	 : (type) == 'b' ? (uint32_t) 1					\
+	 : (uint32_t) 0)
+
+#define val(arg, type, ctype)						\
+	(  (type) == 'U' ? (ctype) (arg).u				\
+	 : (type) == 'I' ? (ctype) (arg).i				\
+	 : (type) == 'F' ? (ctype) (arg).f				\
+	 : (type) == 'z' ? (ctype) indirect((arg).u, uint64_t)		\
+	 : (type) == 'l' ? (ctype) indirect((arg).u, int64_t)		\
+	 : (type) == 'd' ? (ctype) indirect((arg).u, double)		\
+	 : (type) == 'u' ? (ctype) indirect((arg).u, uint32_t)		\
+	 : (type) == 'i' ? (ctype) indirect((arg).u, int32_t)		\
+	 : (type) == 'f' ? (ctype) indirect((arg).u, float)		\
+	 : (type) == 'h' ? (ctype) indirect((arg).u, uint16_t)		\
+	 : (type) == 's' ? (ctype) indirect((arg).u, int16_t)		\
+	 : (type) == 'c' ? (ctype) indirect((arg).u, uint8_t)		\
+	 : (type) == 'b' ? (ctype) indirect((arg).u, int8_t)		\
+	 : (ctype) 0)
+
+
+/* memory management */
+
+#define page_round(len, page) (((len) + (page) - 1) / (page) * (page))
+
+/* reserve the address space for the whole of memory, without making any of
+ * it accessible, plus a page past the end so that any value the machine
+ * can address lies within the reservation */
+static int reserve_mem(nevm *vm) {
+	void *mem;
+	size_t page;
+	page = sysconf(_SC_PAGESIZE);
+#if SIZE_MAX > UINT32_MAX
+	/* all of it, so that the limit may be raised after memory exists */
+	vm->reserved = (size_t) UINT32_MAX + 1 + page;
+#else
+	vm->reserved = page_round((size_t) vm->config.brk_max, page) + page;
+#endif
+	mem = mmap(NULL, vm->reserved, PROT_NONE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) {
+		vm->reserved = 0;
+		return -1;
+	}
+	vm->mem = mem;
+	return 0;
+}
+
+/* move the break up to addr, making more pages accessible if needed. new
+ * pages are zeroed by the kernel. addr is wide enough to hold the end of a
+ * value at the top of the address space. */
+static int grow_brk(nevm *vm, uint64_t addr) {
+	size_t len, limit, page;
+	if (addr > vm->config.brk_max) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (vm->mem == NULL && reserve_mem(vm) != 0) {
+		return -1;
+	}
+	if (addr > vm->committed) {
+		page = sysconf(_SC_PAGESIZE);
+		len = page_round((size_t) addr, page);
+		limit = page_round((size_t) vm->config.brk_max, page);
+		if (len < vm->committed * 2) {
+			len = vm->committed * 2;
+		}
+		if (len > limit) {
+			len = limit;
+		}
+		if (mprotect(vm->mem + vm->committed,
+			     len - vm->committed,
+			     PROT_READ | PROT_WRITE) != 0) {
+			return -1;
+		}
+		vm->committed = len;
+	}
+	vm->brk = (uint32_t) addr;
+	return 0;
+}
+
+static inline int check_brk(nevm *vm, uint64_t addr) {
+	if (addr <= vm->brk) {
+		return 0;
+	}
+	return grow_brk(vm, addr);
+}
+
+static void assert_brk(nevm *vm, uint64_t addr, uint32_t addr_addr) {
+	if (check_brk(vm, addr) != 0) {
+		fatal("0x%x:Could not create memory for address at 0x%x:"
+		      " 0x%" PRIx64 "\n",
+		      indirect(0, uint32_t), addr_addr, addr);
+	}
+}
+
+
+/* guard pages
+ *
+ * With guard pages, all memory up to the limit, rounded up to a whole page,
+ * is made accessible before the machine starts, and the rest of the
+ * reservation is left inaccessible. The break is moved up to the limit, as
+ * the machine may write anywhere below it without the break hearing of it,
+ * and snapshots, traces and reads must see all of it. Arguments aren't
+ * checked against the break as operations are decoded; instead, an access
+ * past the limit faults, and the operation being performed is validated
+ * again, with all of the checks, to report exactly what's wrong with it.
+ *
+ * The fault handler is shared by every machine, and finds the one at fault
+ * by the thread it happened on. It's installed while any machine using
+ * guard pages exists, and the process's own handler is put back when the
+ * last of them is freed. Faults which aren't a machine's are passed on to
+ * that handler. */
+
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned guard_users; /* machines holding the handler */
+static struct sigaction guard_old; /* the handler to restore */
+
+static operation *validate(nevm *vm, uint32_t ip, bool check_ranges);
+
+/* pass a fault on to the handler there was before ours */
+static void guard_chain(int sig, siginfo_t *info, void *context) {
+	if (guard_old.sa_flags & SA_SIGINFO) {
+		guard_old.sa_sigaction(sig, info, context);
+	} else if (guard_old.sa_handler != SIG_DFL
+		   && guard_old.sa_handler != SIG_IGN) {
+		guard_old.sa_handler(sig);
+	} else {
+		/* die as usual when the access is retried; a fault can't
+		 * be ignored */
+		signal(sig, SIG_DFL);
+	}
+}
+
+static void guard_fault(int sig, siginfo_t *info, void *context) {
+	nevm *vm;
+	char *addr;
+	uint32_t ip;
+	vm = running_vm;
+	addr = info->si_addr;
+	if (vm == NULL || vm->mem == NULL || addr < vm->mem
+	    || addr >= vm->mem + vm->reserved) {
+		guard_chain(sig, info, context);
+		return;
+	}
+	/* the IP has already been advanced past the operation */
+	ip = indirect(0, uint32_t) - sizeof(operation);
+	indirect(0, uint32_t) = ip;
+	validate(vm, ip, true);
+	fatal("0x%x:Invalid access to memory at 0x%x\n",
+	      ip, caddr2addr(addr));
+}
+
+/* install the fault handler for the machine, if it isn't already */
+static int guard_hold(nevm *vm) {
+	struct sigaction sa;
+	int ret = 0;
+	if (vm->guarded) {
+		return 0;
+	}
+	pthread_mutex_lock(&guard_lock);
+	if (guard_users == 0) {
+		sa.sa_sigaction = guard_fault;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_SIGINFO;
+		ret = sigaction(SIGSEGV, &sa, &guard_old);
+	}
+	if (ret == 0) {
+		guard_users++;
+		vm->guarded = true;
+	}
+	pthread_mutex_unlock(&guard_lock);
+	return ret;
+}
+
+/* give up the machine's hold on the fault handler, restoring the old one
+ * if no other machine needs it */
+static void guard_release(nevm *vm) {
+	if (!vm->guarded) {
+		return;
+	}
+	pthread_mutex_lock(&guard_lock);
+	if (--guard_users == 0) {
+		sigaction(SIGSEGV, &guard_old, NULL);
+	}
+	vm->guarded = false;
+	pthread_mutex_unlock(&guard_lock);
+}
+
+static void guard_mem(nevm *vm) {
+	size_t page, len;
+	if (vm->mem == NULL && reserve_mem(vm) != 0) {
+		fatal("Could not reserve memory: %s\n", strerror(errno));
+	}
+	page = sysconf(_SC_PAGESIZE);
+	len = page_round((size_t) vm->config.brk_max, page);
+	if (len > vm->committed) {
+		if (mprotect(vm->mem + vm->committed,
+			     len - vm->committed,
+			     PROT_READ | PROT_WRITE) != 0) {
+			fatal("Could not create memory: %s\n",
+			      strerror(errno));
+		}
+		vm->committed = len;
+	}
+	vm->brk = vm->config.brk_max;
+	if (guard_hold(vm) != 0) {
+		fatal("Could not catch faults: %s\n", strerror(errno));
+	}
+}
+
+
+/* snapshots
+ *
+ * A snapshot holds the machine's memory up to the break, preceded by a
+ * header padded out to a page, so that restoring it can map the memory
+ * straight from the file, privately, with the pages read in only as they
+ * are touched. Memory which is all zeros is left as holes in the file. */
+
+#define SNAPSHOT_MAGIC "NESNAP1"
+
+typedef struct {
+	char magic[8];
+	uint32_t offset; /* of the memory in the file */
+	uint32_t brk;
+	uint32_t brk_max;
+} snapshot_header;
+
+static int write_all(int fd, const char *buf, size_t len) {
+	ssize_t r;
+	while (len > 0) {
+		r = write(fd, buf, len);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static void write_snapshot(nevm *vm, const char *filename) {
+	snapshot_header h;
+	char *header, *zeros;
+	size_t page, addr, len;
+	int fd, err;
+
+	/* a page for the header, then a page of zeros */
+	page = sysconf(_SC_PAGESIZE);
+	header = calloc(2, page);
+	if (header == NULL) {
+		fatal("Could not allocate memory for snapshot\n");
+	}
+	zeros = header + page;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.offset = page;
+	h.brk = vm->brk;
+	h.brk_max = vm->config.brk_max;
+	memcpy(header, &h, sizeof(h));
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 || write_all(fd, header, page) != 0) {
+		goto error;
+	}
+	for (addr = 0; addr < vm->brk; addr += len) {
+		len = vm->brk - addr < page ? vm->brk - addr : page;
+		if (memcmp(addr2caddr(addr), zeros, len) == 0) {
+			/* leave a hole */
+			if (lseek(fd, len, SEEK_CUR) < 0) {
+				goto error;
+			}
+		} else if (write_all(fd, addr2caddr(addr), len) != 0) {
+			goto error;
+		}
+	}
+	if (ftruncate(fd, page + vm->brk) != 0 || close(fd) != 0) {
+		fd = -1;
+		goto error;
+	}
+	free(header);
+	return;
+
+error:
+	err = errno;
+	free(header);
+	if (fd >= 0) {
+		close(fd);
+	}
+	fatal("Couldn't write snapshot \"%s\": %s\n",
+	      filename, strerror(err));
+}
+
+/* restore the machine from the snapshot in filename */
+static void restore_snapshot(nevm *vm, const char *filename) {
+	snapshot_header h;
+	struct stat st;
+	size_t page, len;
+	int fd, err;
+
+	if (vm->brk != 0) {
+		fatal("A snapshot must be restored before loading files\n");
+	}
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fatal("Couldn't open file \"%s\": %s\n",
+		      filename, strerror(errno));
+	}
+	if (fstat(fd, &st) != 0) {
+		goto error;
+	}
+	if (read(fd, &h, sizeof(h)) != sizeof(h)
+	    || memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0
+	    || (uint64_t) h.offset + h.brk > (uint64_t) st.st_size
+	    || h.brk > h.brk_max) {
+		close(fd);
+		fatal("Not a snapshot: \"%s\"\n", filename);
+	}
+	/* the snapshot's memory must fit under the limit */
+	if (h.brk_max > vm->config.brk_max) {
+		vm->config.brk_max = h.brk_max;
+	}
+	if (vm->mem == NULL && reserve_mem(vm) != 0) {
+		err = errno;
+		close(fd);
+		fatal("Could not reserve memory: %s\n", strerror(err));
+	}
+	page = sysconf(_SC_PAGESIZE);
+	len = page_round((size_t) h.brk, page);
+	if (h.offset % page == 0) {
+		/* map it over the start of the reservation */
+		if (len != 0
+		    && mmap(vm->mem, len, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_FIXED, fd, h.offset)
+		       == MAP_FAILED) {
+			err = errno;
+			close(fd);
+			fatal("Couldn't map file \"%s\": %s\n",
+			      filename, strerror(err));
+		}
+		vm->committed = len;
+		vm->brk = h.brk;
+	} else {
+		/* written with a different page size; read it in */
+		if (check_brk(vm, h.brk) != 0
+		    || pread(fd, vm->mem, h.brk, h.offset)
+		       != (ssize_t) h.brk) {
+			goto error;
+		}
+	}
+	close(fd);
+	return;
+
+error:
+	err = errno;
+	close(fd);
+	fatal("Couldn't read from file \"%s\": %s\n",
+	      filename, strerror(err));
+}
+
+
+/* validation */
+
+static bool is_arg_type(char arg_type) {
+	switch (arg_type) {
+	case 'U':
+	case 'I':
+	case 'F':
+	case 'z':
+	case 'l':
+	case 'd':
+	case 'u':
+	case 'i':
+	case 'f':
+	case 'h':
+	case 's':
+	case 'c':
+	case 'b':
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void validate_arg(nevm *vm, uint32_t addr, char arg_type,
+			 uint32_t addr_addr, uint32_t arg_type_addr) {
+	switch (arg_type) {
+	case 'U':
+	case 'I':
+	case 'F':
+		break;
+	case 'z':
+	case 'l':
+	case 'd':
+		assert_brk(vm, (uint64_t) addr + 8, addr_addr);
+		break;
+	case 'u':
+	case 'i':
+	case 'f':
+		assert_brk(vm, (uint64_t) addr + 4, addr_addr);
+		break;
+	case 'h':
+	case 's':
+		assert_brk(vm, (uint64_t) addr + 2, addr_addr);
+		break;
+	case 'c':
+	case 'b':
+		assert_brk(vm, (uint64_t) addr + 1, addr_addr);
+		break;
+	default:
+		fatal("0x%x:Invalid type at 0x%x: %c\n",
+		      indirect(0, uint32_t), arg_type_addr, arg_type);
+	}
+}
+
+static bool is_op(char op) {
+	switch (op) {
+	case '_': /* No op */
+	case '=': /* Assign */
+	case '@': /* Block transfer */
+	case '!': /* Not */
+	case '&': /* And */
+	case '|': /* Or */
+	case '^': /* Xor */
+	case '<': /* Shift left */
+	case '>': /* Shift right */
+	case '~': /* Negate */
+	case '+': /* Add */
+	case '-': /* Subtract */
+	case '*': /* Multiply */
+	case '/': /* Divide */
+	case '%': /* Remainder */
+	case '#': /* Halt */
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void validate_op(nevm *vm, char op, uint32_t op_addr) {
+	if (!is_op(op)) {
+		fatal("0x%x:Invalid operation at 0x%x: %c\n",
+		      indirect(0, uint32_t), op_addr, op);
+	}
+}
+
+/* macros for translating between operations and C operations */
+
+#define unary_op(op, cop)						\
+do {									\
+	switch (op->dst_type) {						\
+	case 'U':							\
+		op->dst.u = cop val(op->src1, op->src1_type, uint32_t);	\
+		break;							\
+	case 'I':							\
+		op->dst.i = cop val(op->src1, op->src1_type, int32_t);	\
+		break;							\
+	case 'F':							\
+		op->dst.f = cop val(op->src1, op->src1_type, float);	\
+		break;							\
+	case 'z':							\
+		indirect(op->dst.u, uint64_t)				\
+			= cop val(op->src1, op->src1_type, uint64_t);	\
+		break;							\
+	case 'l':							\
+		indirect(op->dst.u, int64_t)				\
+			= cop val(op->src1, op->src1_type, int64_t);	\
+		break;							\
+	case 'd':							\
+		indirect(op->dst.u, double)				\
+			= cop val(op->src1, op->src1_type, double);	\
+		break;							\
+	case 'u':							\
+		indirect(op->dst.u, uint32_t)				\
+			= cop val(op->src1, op->src1_type, uint32_t);	\
+		break;							\
+	case 'i':							\
+		indirect(op->dst.u, int32_t)				\
+			= cop val(op->src1, op->src1_type, int32_t);	\
+		break;							\
+	case 'f':							\
+		indirect(op->dst.u, float)				\
+			= cop val(op->src1, op->src1_type, float);	\
+		break;							\
+	case 'h':							\
+		indirect(op->dst.u, uint16_t)				\
+			= cop val(op->src1, op->src1_type, uint16_t);	\
+		break;							\
+	case 's':							\
+		indirect(op->dst.u, int16_t)				\
+			= cop val(op->src1, op->src1_type, int16_t);	\
+		break;							\
+	case 'c':							\
+		indirect(op->dst.u, uint8_t)				\
+			= cop val(op->src1, op->src1_type, uint8_t);	\
+		break;							\
+	case 'b':							\
+		indirect(op->dst.u, int8_t)				\
+			= cop val(op->src1, op->src1_type, int8_t);	\
+		break;							\
+	}								\
+} while (0)
+
+#define unary_op_nofloat(op, cop)					\
+do {									\
+	switch (op->dst_type) {						\
+	case 'U':							\
+		op->dst.u = cop val(op->src1, op->src1_type, uint32_t);	\
+		break;							\
+	case 'I':							\
+		op->dst.i = cop val(op->src1, op->src1_type, int32_t);	\
+		break;							\
+	case 'z':							\
+		indirect(op->dst.u, uint64_t)				\
+			= cop val(op->src1, op->src1_type, uint64_t);	\
+		break;							\
+	case 'l':							\
+		indirect(op->dst.u, int64_t)				\
+			= cop val(op->src1, op->src1_type, int64_t);	\
+		break;							\
+	case 'u':							\
+		indirect(op->dst.u, uint32_t)				\
+			= cop val(op->src1, op->src1_type, uint32_t);	\
+		break;							\
+	case 'i':							\
+		indirect(op->dst.u, int32_t)				\
+			= cop val(op->src1, op->src1_type, int32_t);	\
+		break;							\
+	case 'h':							\
+		indirect(op->dst.u, uint16_t)				\
+			= cop val(op->src1, op->src1_type, uint16_t);	\
+		break;							\
+	case 's':							\
+		indirect(op->dst.u, int16_t)				\
+			= cop val(op->src1, op->src1_type, int16_t);	\
+		break;							\
+	case 'c':							\
+		indirect(op->dst.u, uint8_t)				\
+			= cop val(op->src1, op->src1_type, uint8_t);	\
+		break;							\
+	case 'b':							\
+		indirect(op->dst.u, int8_t)				\
+			= cop val(op->src1, op->src1_type, int8_t);	\
+		break;							\
+	}								\
+} while (0)
+
+#define binary_op(op, cop)						\
+do {									\
+	switch (op->dst_type) {						\
+	case 'U':							\
+		op->dst.u = val(op->src1, op->src1_type, uint32_t)	\
+			    cop val(op->src2, op->src2_type, uint32_t);	\
+		break;							\
+	case 'I':							\
+		op->dst.i = val(op->src1, op->src1_type, int32_t)	\
+			    cop val(op->src2, op->src2_type, int32_t);	\
+		break;							\
+	case 'F':							\
+		op->dst.f = val(op->src1, op->src1_type, float)		\
+			    cop val(op->src2, op->src2_type, float);	\
+		break;							\
+	case 'z':							\
+		indirect(op->dst.u, uint64_t)				\
+			= val(op->src1, op->src1_type, uint64_t)	\
+			  cop val(op->src2, op->src2_type, uint64_t);	\
+		break;							\
+	case 'l':							\
+		indirect(op->dst.u, int64_t)				\
+			= val(op->src1, op->src1_type, int64_t)		\
+			  cop val(op->src2, op->src2_type, int64_t);	\
+		break;							\
+	case 'd':							\
+		indirect(op->dst.u, double)				\
+			= val(op->src1, op->src1_type, double)		\
+			  cop val(op->src2, op->src2_type, double);	\
+		break;							\
+	case 'u':							\
+		indirect(op->dst.u, uint32_t)				\
+			= val(op->src1, op->src1_type, uint32_t)	\
+			  cop val(op->src2, op->src2_type, uint32_t);	\
+		break;							\
+	case 'i':							\
+		indirect(op->dst.u, int32_t)				\
+			= val(op->src1, op->src1_type, int32_t)		\
+			  cop val(op->src2, op->src2_type, int32_t);	\
+		break;							\
+	case 'f':							\
+		indirect(op->dst.u, float)				\
+			= val(op->src1, op->src1_type, float)		\
+			  cop val(op->src2, op->src2_type, float);	\
+		break;							\
+	case 'h':							\
+		indirect(op->dst.u, uint16_t)				\
+			= val(op->src1, op->src1_type, uint16_t)	\
+			  cop val(op->src2, op->src2_type, uint16_t);	\
+		break;							\
+	case 's':							\
+		indirect(op->dst.u, int16_t)				\
+			= val(op->src1, op->src1_type, int16_t)		\
+			  cop val(op->src2, op->src2_type, int16_t);	\
+		break;							\
+	case 'c':							\
+		indirect(op->dst.u, uint8_t)				\
+			= val(op->src1, op->src1_type, uint8_t)		\
+			  cop val(op->src2, op->src2_type, uint8_t);	\
+		break;							\
+	case 'b':							\
+		indirect(op->dst.u, int8_t)				\
+			= val(op->src1, op->src1_type, int8_t)		\
+			  cop val(op->src2, op->src2_type, int8_t);	\
+		break;							\
+	}								\
+} while (0)
+
+#define binary_op_nofloat(op, cop)					\
+do {									\
+	switch (op->dst_type) {						\
+	case 'U':							\
+		op->dst.u = val(op->src1, op->src1_type, uint32_t)	\
+			    cop val(op->src2, op->src2_type, uint32_t);	\
+		break;							\
+	case 'I':							\
+		op->dst.i = val(op->src1, op->src1_type, int32_t)	\
+			    cop val(op->src2, op->src2_type, int32_t);	\
+		break;							\
+	case 'z':							\
+		indirect(op->dst.u, uint64_t)				\
+			= val(op->src1, op->src1_type, uint64_t)	\
+			  cop val(op->src2, op->src2_type, uint64_t);	\
+		break;							\
+	case 'l':							\
+		indirect(op->dst.u, int64_t)				\
+			= val(op->src1, op->src1_type, int64_t)		\
+			  cop val(op->src2, op->src2_type, int64_t);	\
+		break;							\
+	case 'u':							\
+		indirect(op->dst.u, uint32_t)				\
+			= val(op->src1, op->src1_type, uint32_t)	\
+			  cop val(op->src2, op->src2_type, uint32_t);	\
+		break;							\
+	case 'i':							\
+		indirect(op->dst.u, int32_t)				\
+			= val(op->src1, op->src1_type, int32_t)		\
+			  cop val(op->src2, op->src2_type, int32_t);	\
+		break;							\
+	case 'h':							\
+		indirect(op->dst.u, uint16_t)				\
+			= val(op->src1, op->src1_type, uint16_t)	\
+			  cop val(op->src2, op->src2_type, uint16_t);	\
+		break;							\
+	case 's':							\
+		indirect(op->dst.u, int16_t)				\
+			= val(op->src1, op->src1_type, int16_t)		\
+			  cop val(op->src2, op->src2_type, int16_t);	\
+		break;							\
+	case 'c':							\
+		indirect(op->dst.u, uint8_t)				\
+			= val(op->src1, op->src1_type, uint8_t)		\
+			  cop val(op->src2, op->src2_type, uint8_t);	\
+		break;							\
+	case 'b':							\
+		indirect(op->dst.u, int8_t)				\
+			= val(op->src1, op->src1_type, int8_t)		\
+			  cop val(op->src2, op->src2_type, int8_t);	\
+		break;							\
+	}								\
+} while (0)
+
+/* operation handlers
+ *
+ * Arithmetic, bitwise and assignment operations are normally performed by
+ * the specialized handlers in ops.c. Building with NEVM_MACRO_OPS instead
+ * uses the macros above, which look at the types on every operation, for
+ * comparison. */
+
+#define decoded_op(mem, d) ((operation *) ((mem) + (d)->ip))
+
+static void op_nop(char *mem, const decoded *d) {
+	(void) mem;
+	(void) d;
+}
+
+static void op_block(char *mem, const decoded *d) {
+	memmove(mem + d->dst, mem + d->src1, d->wlen);
+}
+
+#ifdef NEVM_MACRO_OPS
+
+/* the handlers are only given the base of memory */
+#undef addr2caddr
+#define addr2caddr(addr) (mem + (addr))
+
+static void op_assign(char *mem, const decoded *d) {
+	operation *op = decoded_op(mem, d);
+	unary_op(op, +);
+}
+
+static void op_not(char *mem, const decoded *d) {
+	operation *op = decoded_op(mem, d);
+	unary_op_nofloat(op, ~);
+}
+
+static void op_and(char *mem, const decoded *d) {
+	operation *op = decoded_op(mem, d);
+	binary_op_nofloat(op, &);
+}
+
+static void op_or(char *mem, const decoded *d) {
+	operation *op = decoded_op(mem, d);
+	binary_op_nofloat(op, |);
+}
+
+static void op_xor(char *mem, const decoded *d) {
+	operation *op = decoded_op(mem, d);
+	binary_op_nofloat(op, ^);
+}
+
+static void op_shl(char *mem, const decoded *d) {
+	operation *op = decoded_op(mem, d);
+	binary_op_nofloat(op, <<);
+}
+
+static void op_shr(char *mem, const decoded *d) {
+	operation *op = decoded_op(mem, d);
+	binary_op_nofloat(op, >>);
+}
+
+static void op_neg(char *mem, const decoded *d) {
+	operation *op = decoded_op(mem, d);
+	unary_op(op, -);
+}
+
+static void op_add(char *mem, const decoded *d) {
+	operation *op = decoded_op(mem, d);
+	binary_op(op, +);
+}
+
+static void op_sub(char *mem, const decoded *d) {
+	operation *op = decoded_op(mem, d);
+	binary_op(op, -);
+}
+
+static void op_mul(char *mem, const decoded *d) {
+	operation *op = decoded_op(mem, d);
+	binary_op(op, *);
+}
+
+static void op_div(char *mem, const decoded *d) {
+	operation *op = decoded_op(mem, d);
+	binary_op(op, /);
+}
+
+static void op_rem(char *mem, const decoded *d) {
+	operation *op = decoded_op(mem, d);
+	switch (op->dst_type) {
+	case 'F':
+		op->dst.f = fmodf(val(op->src1, op->src1_type, float),
+				  val(op->src2, op->src2_type, float));
+		break;
+	case 'f':
+		indirect(op->dst.u, float)
+			= fmodf(val(op->src1, op->src1_type, float),
+				val(op->src2, op->src2_type, float));
+		break;
+	case 'd':
+		indirect(op->dst.u, double)
+			= fmod(val(op->src1, op->src1_type, double),
+			       val(op->src2, op->src2_type, double));
+		break;
+	default:
+		binary_op_nofloat(op, %);
+		break;
+	}
+}
+
+static const op_handler macro_handlers[256] = {
+	['='] = op_assign,
+	['!'] = op_not,
+	['&'] = op_and,
+	['|'] = op_or,
+	['^'] = op_xor,
+	['<'] = op_shl,
+	['>'] = op_shr,
+	['~'] = op_neg,
+	['+'] = op_add,
+	['-'] = op_sub,
+	['*'] = op_mul,
+	['/'] = op_div,
+	['%'] = op_rem
+};
+
+#undef addr2caddr
+#define addr2caddr(addr) (vm->mem + (addr))
+
+#define lookup_handler(op)						\
+	macro_handlers[(unsigned char) (op)->op]
+
+#else
+
+#define lookup_handler(op)						\
+	ops_lookup((op)->op, (op)->dst_type, (op)->src1_type, (op)->src2_type)
+
+#endif
+
+/* frame timing */
+
+#define timespec_add(a, b) do {						\
+	(a).tv_sec += (b).tv_sec;					\
+	(a).tv_nsec += (b).tv_nsec;					\
+	if ((a).tv_nsec >= 1000000000) {				\
+		(a).tv_sec++;						\
+		(a).tv_nsec -= 1000000000;				\
+	}								\
+} while (0)
+
+#define timespec_ge(a, b)						\
+	((a).tv_sec > (b).tv_sec					\
+	 || ((a).tv_sec == (b).tv_sec && (a).tv_nsec >= (b).tv_nsec))
+
+#define timespec_ns(a)							\
+	((uint64_t) (a).tv_sec * 1000000000 + (uint64_t) (a).tv_nsec)
+
+
+/* the profiler
+ *
+ * When profiling, the run loop polls before every operation, and the poll
+ * reads the IP from memory, counts an execution of the slot it points to,
+ * and charges the time since the last poll to the slot before. A write to a
+ * slot which has been run is counted as a rewrite of it if it touches any
+ * word which affects decoding, whether or not the slot is in the decode
+ * cache at the time. The counts are kept in a
+ * two-level table, so that only the parts of memory holding code need any
+ * space. */
+
+#define PROFILE_CHUNK_BITS 16
+#define PROFILE_CHUNK_SLOTS ((1 << PROFILE_CHUNK_BITS) / sizeof(operation))
+
+struct profile_slot {
+	unsigned long count;
+	unsigned long rewrites;
+	uint64_t ns;
+};
+
+struct profile {
+	struct profile_slot *chunks[1 << (32 - PROFILE_CHUNK_BITS)];
+	bool running;
+	uint32_t ip; /* the operation being timed */
+	struct timespec then;
+};
+
+static struct profile_slot *profile_slot(nevm *vm, uint32_t addr) {
+	struct profile_slot **chunk;
+	chunk = &vm->profile->chunks[addr >> PROFILE_CHUNK_BITS];
+	if (*chunk == NULL) {
+		*chunk = calloc(PROFILE_CHUNK_SLOTS,
+				sizeof(struct profile_slot));
+		if (*chunk == NULL) {
+			fatal("Could not allocate memory for profile\n");
+		}
+	}
+	return &(*chunk)[(addr & ((1 << PROFILE_CHUNK_BITS) - 1))
+			 / sizeof(operation)];
+}
+
+/* charge the time since the last sample to the last operation */
+static void profile_charge(nevm *vm, struct timespec now) {
+	if (vm->profile->running) {
+		profile_slot(vm, vm->profile->ip)->ns
+			+= timespec_ns(now) - timespec_ns(vm->profile->then);
+	}
+	vm->profile->then = now;
+}
+
+/* count the operation about to be performed */
+static void profile_sample(nevm *vm) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	profile_charge(vm, now);
+	vm->profile->ip = indirect(0, uint32_t);
+	vm->profile->running = true;
+	profile_slot(vm, vm->profile->ip)->count++;
+}
+
+
+/* the decode cache
+ *
+ * Each aligned operation is validated and decoded once, and the result is
+ * cached by its address. Since programs rewrite themselves constantly, every
+ * write to memory is checked against the cache, and the entry for any
+ * operation whose decoding the write could change is dropped. Only the op and
+ * type bytes, and the values of indirect arguments, affect decoding; writes
+ * to immediate values (e.g. the destination of an operation with an
+ * immediate destination type) leave the entry in place. */
+
+#define DCACHE_MASK (DCACHE_SIZE - 1)
+#define DCACHE_EMPTY 1 /* never the address of a cached operation */
+
+/* words of the operation which affect decoding */
+#define LIVE_OP 0x1
+#define LIVE_DST 0x2
+#define LIVE_SRC1 0x4
+#define LIVE_SRC2 0x8
+
+#define is_indirect(type) ((type) != 'U' && (type) != 'I' && (type) != 'F')
+
+/* the words of op which affect decoding */
+static inline uint8_t live_words(const operation *op) {
+	uint8_t live;
+	live = LIVE_OP;
+	if (is_indirect(op->dst_type)) {
+		live |= LIVE_DST;
+	}
+	if (is_indirect(op->src1_type)) {
+		live |= LIVE_SRC1;
+	}
+	if (is_indirect(op->src2_type) || op->op == '@') {
+		live |= LIVE_SRC2;
+	}
+	return live;
+}
+
+/* the run loop's jump targets for each operation */
+#ifdef NEVM_THREADED
+#define dispatch_target(op) vm->dispatch[(unsigned char) (op)]
+#else
+#define dispatch_target(op) NULL
+#endif
+
+/* dispatched on in place of the operation which begins a fused sequence */
+#define FUSED_OP 0
+
+#define fused_entry(addr) (&vm->fused[((addr) >> 4) & (FUSED_SLOTS - 1)])
+
+static void validate_block(nevm *vm, operation *op) {
+	assert_brk(vm, (uint64_t) valaddr(op->dst, op->dst_type)
+		   + (uint64_t) valsize(op->dst_type)
+		     * val(op->src2, op->src2_type, uint32_t),
+		   caddr2addr(&op->dst.u));
+	assert_brk(vm, (uint64_t) valaddr(op->src1, op->src1_type)
+		   + (uint64_t) valsize(op->dst_type)
+		     * val(op->src2, op->src2_type, uint32_t),
+		   caddr2addr(&op->src1.u));
+}
+
+static void validate_args(nevm *vm, operation *op) {
+	validate_arg(vm, op->dst.u, op->dst_type,
+		     caddr2addr(&op->dst.u),
+		     caddr2addr(&op->dst_type));
+	validate_arg(vm, op->src1.u, op->src1_type,
+		     caddr2addr(&op->src1.u),
+		     caddr2addr(&op->src1_type));
+	validate_arg(vm, op->src2.u, op->src2_type,
+		     caddr2addr(&op->src2.u),
+		     caddr2addr(&op->src2_type));
+}
+
+/* with guard pages, whether the limit falls part way through a page, so
+ * that memory just past it is accessible and must be checked for */
+#define guard_short(vm)							\
+	((vm)->config.guard && (vm)->committed > (vm)->config.brk_max)
+
+/* whether any indirect argument of op reaches past the limit */
+static bool past_limit(nevm *vm, operation *op) {
+	uint64_t limit;
+	limit = vm->config.brk_max;
+	return (is_indirect(op->dst_type)
+		&& (uint64_t) op->dst.u + valsize(op->dst_type) > limit)
+	       || (is_indirect(op->src1_type)
+		   && (uint64_t) op->src1.u + valsize(op->src1_type) > limit)
+	       || (is_indirect(op->src2_type)
+		   && (uint64_t) op->src2.u + valsize(op->src2_type) > limit);
+}
+
+/* validate the operation at ip. unless check_ranges is set, whether the
+ * arguments are in range is left to the guard pages, to be found when the
+ * operation is performed; but if anything else is wrong with the operation,
+ * or an argument reaches into the part of the last page past the limit,
+ * they are checked anyway, so that the first error is reported just as it
+ * would be otherwise. */
+static operation *validate(nevm *vm, uint32_t ip, bool check_ranges) {
+	operation *op;
+	int r;
+
+	/* check that the IP is pointing to existing memory */
+	r = check_brk(vm, (uint64_t) ip + sizeof(operation));
+	if (r != 0) {
+		fatal("Invalid IP: 0x%x\n", ip);
+	}
+	/* read the operation */
+	op = (operation *) (vm->mem + ip);
+	/* validate the operation and its arguments */
+	validate_op(vm, op->op, caddr2addr(&op->op));
+	if (check_ranges || !is_arg_type(op->dst_type)
+	    || !is_arg_type(op->src1_type) || !is_arg_type(op->src2_type)
+	    || (guard_short(vm) && past_limit(vm, op))) {
+		validate_args(vm, op);
+	}
+	/* op-specific validation */
+	switch (op->op) {
+	case '@':
+		if (check_ranges || guard_short(vm)) {
+			validate_block(vm, op);
+		}
+		break;
+	case '!':
+	case '&':
+	case '|':
+	case '^':
+	case '<':
+	case '>':
+		if (op->dst_type == 'F'
+		    || op->dst_type == 'f'
+		    || op->dst_type == 'd') {
+			validate_args(vm, op);
+			fatal("0x%x:Invalid type at 0x%x: %c. Floating"
+			      " type cannot be used with bitwise"
+			      " operator %c\n",
+			      ip, caddr2addr(&op->dst_type),
+			      op->dst_type, op->op);
+		}
+		break;
+	}
+	return op;
+}
+
+/* the number of operations after the one at ip which, along with it, make
+ * up a sequence worth fusing, or 0 */
+static uint32_t fuse_length(nevm *vm, uint32_t ip) {
+	operation *op;
+	struct fused_slot *f;
+	uint32_t slot;
+	if (ip % sizeof(operation) != 0
+	    || (uint64_t) ip + 2*sizeof(operation) > vm->brk) {
+		return 0;
+	}
+	op = (operation *) addr2caddr(ip);
+	/* a call: +uuU call_next IP 0x10, then =uU IP call */
+	if (op[0].op == '+' && is_indirect(op[0].src1_type)
+	    && op[0].src1.u == 0 && op[1].op == '='
+	    && is_indirect(op[1].dst_type) && op[1].dst.u == 0) {
+		return 1;
+	}
+	/* a branch: a mask made from a comparison chooses between two
+	 * operations, which are |ed together into the slot which follows */
+	slot = ip + 6*sizeof(operation);
+	if ((uint64_t) slot + sizeof(operation) <= vm->brk
+	    && op[0].op == '-' && op[1].op == '>' && op[2].op == '!'
+	    && op[3].op == '&' && op[4].op == '&' && op[5].op == '|'
+	    && valaddr(op[5].dst, op[5].dst_type) == slot
+	    && valsize(op[5].dst_type) == sizeof(uint32_t)) {
+		/* keep the decodings of the slot as it is rewritten */
+		f = fused_entry(slot);
+		if (f->ip != slot) {
+			f->ip = slot;
+			f->nkept = 0;
+			f->next = 0;
+		}
+		return 6;
+	}
+	return 0;
+}
+
+/* validate and decode the operation at ip into d */
+static void decode(nevm *vm, uint32_t ip, decoded *d) {
+	operation *op;
+
+	op = validate(vm, ip, !vm->config.guard);
+	d->ip = ip;
+	d->op = op->op;
+	d->dst = valaddr(op->dst, op->dst_type);
+	d->src1 = valaddr(op->src1, op->src1_type);
+	d->src2 = valaddr(op->src2, op->src2_type);
+	/* find the handler, and what the operation will write */
+	switch (op->op) {
+	case '_':
+	case '#':
+		d->exec = op_nop;
+		d->wlen = 0;
+		break;
+	case '@':
+		/* the length is found when performed */
+		d->exec = op_block;
+		d->wlen = 0;
+		break;
+	default:
+		d->exec = lookup_handler(op);
+		d->wlen = valsize(op->dst_type);
+		break;
+	}
+	/* whether the write needs looking at beyond its own slot, which is
+	 * settled here rather than each time the operation is performed */
+	d->wide = (d->dst & (sizeof(operation) - 1)) + d->wlen
+		  > sizeof(operation)
+		  || io_overlaps(vm, d->dst, d->wlen);
+	d->heat = 0;
+	d->jit_refs = 0;
+	d->block = NULL;
+	d->live = live_words(op);
+	d->fused = d->dst >= sizeof(uint32_t) ? fuse_length(vm, ip) : 0;
+	d->target = dispatch_target(d->fused != 0 ? FUSED_OP : op->op);
+}
+
+/* native code
+ *
+ * Runs of operations which are jumped to often are compiled to native code,
+ * in blocks which end at the first operation to write the IP. A block is
+ * thrown away whenever the decode cache entry for any operation in it is
+ * dropped, whether because the operation was rewritten or because another
+ * operation took its place in the cache, so the cache entries of every
+ * operation in a live block are always present. Compiled code checks the
+ * cache tag of each slot it writes, and calls mem_written_range() when it
+ * matches, so writes from compiled code throw away code just as writes from
+ * the interpreter do. A block never includes an operation which rewrites
+ * any operation in the same block, so a block is never thrown away while it
+ * runs. */
+
+#define JIT_THRESHOLD 64
+#define JIT_BLOCK_MAX 32
+#define JIT_BLOCKS 256
+
+struct jit_block {
+	uint32_t start;
+	uint32_t nops; /* 0 if thrown away */
+	jit_code code;
+	decoded ops[JIT_BLOCK_MAX];
+};
+
+#define dcache_entry(addr) (&vm->dcache[((addr) >> 4) & DCACHE_MASK])
+
+static void jit_discard(nevm *vm, struct jit_block *b) {
+	uint32_t i;
+	decoded *d;
+	for (i = 0; i < b->nops; i++) {
+		d = dcache_entry(b->start + i*sizeof(operation));
+		d->jit_refs--;
+		if (i == 0) {
+			d->block = NULL;
+		}
+	}
+	b->nops = 0;
+	vm->stats.jit_discarded++;
+}
+
+/* throw away any blocks which include the operation at slot */
+static void jit_kill(nevm *vm, uint32_t slot) {
+	uint32_t i;
+	struct jit_block *b;
+	for (i = 0; i < vm->jit.nblocks; i++) {
+		b = &vm->jit.blocks[i];
+		if (b->nops != 0 && slot >= b->start
+		    && slot < b->start + b->nops*sizeof(operation)) {
+			jit_discard(vm, b);
+		}
+	}
+}
+
+/* throw away all blocks */
+static void jit_flush(nevm *vm) {
+	uint32_t i;
+	for (i = 0; i < vm->jit.nblocks; i++) {
+		if (vm->jit.blocks[i].nops != 0) {
+			jit_discard(vm, &vm->jit.blocks[i]);
+		}
+	}
+	vm->jit.nblocks = 0;
+	jit_reset(vm->jit.code);
+}
+
+/* whether [addr, addr + len) overlaps any of the words in live of the
+ * operation at ip */
+static inline bool overlaps_words(uint32_t ip, uint8_t live, uint32_t addr,
+				  uint32_t len) {
+	uint32_t lo, hi;
+	if (len == 0 || addr >= ip + sizeof(operation) || addr + len <= ip) {
+		return false;
+	}
+	lo = addr > ip ? addr - ip : 0;
+	hi = addr + len < ip + sizeof(operation)
+	     ? addr + len - ip : sizeof(operation);
+	return (live & ((1 << ((hi + 3) / 4)) - (1 << (lo / 4)))) != 0;
+}
+
+/* whether [addr, addr + len) overlaps any live words of the operation
+ * decoded in d */
+static inline bool overlaps_live(const decoded *d, uint32_t addr,
+				 uint32_t len) {
+	return overlaps_words(d->ip, d->live, addr, len);
+}
+
+/* count a rewrite of each slot which has been run, and whose operation now
+ * has live words in [addr, addr + len) */
+static void profile_written(nevm *vm, uint32_t addr, uint32_t len) {
+	struct profile_slot *chunk;
+	uint64_t slot, end;
+	end = (uint64_t) addr + len;
+	slot = addr & ~(sizeof(operation) - 1);
+	while (slot < end) {
+		chunk = vm->profile->chunks[slot >> PROFILE_CHUNK_BITS];
+		if (chunk == NULL) {
+			/* nothing in this chunk has been run */
+			slot = (slot | ((1 << PROFILE_CHUNK_BITS) - 1)) + 1;
+			continue;
+		}
+		if (chunk[(slot & ((1 << PROFILE_CHUNK_BITS) - 1))
+			  / sizeof(operation)].count != 0
+		    && slot + sizeof(operation) <= vm->committed
+		    && overlaps_words((uint32_t) slot,
+				      live_words((operation *)
+						 addr2caddr(slot)),
+				      addr, len)) {
+			profile_slot(vm, (uint32_t) slot)->rewrites++;
+		}
+		slot += sizeof(operation);
+	}
+}
+
+/* drop the cached decoding of the operation at slot, if [addr, addr + len)
+ * overlaps any of its live words */
+static inline void dcache_invalidate(nevm *vm, uint32_t slot, uint32_t addr,
+				     uint32_t len) {
+	decoded *d;
+	d = dcache_entry(slot);
+	if (d->ip == slot && overlaps_live(d, addr, len)) {
+		if (d->jit_refs != 0) {
+			jit_kill(vm, slot);
+		}
+		d->ip = DCACHE_EMPTY;
+		vm->stats.invalidations++;
+	}
+}
+
+/* note a write to memory at [addr, addr + len) */
+static void mem_written_range(nevm *vm, uint32_t addr, uint32_t len) {
+	uint32_t slot, i;
+	if (len == 0) {
+		return;
+	}
+	if (len <= DCACHE_SIZE * sizeof(operation)) {
+		for (slot = addr & ~(sizeof(operation) - 1); slot < addr + len;
+		     slot += sizeof(operation)) {
+			dcache_invalidate(vm, slot, addr, len);
+		}
+	} else {
+		for (i = 0; i < DCACHE_SIZE; i++) {
+			slot = vm->dcache[i].ip;
+			if (slot != DCACHE_EMPTY
+			    && slot + sizeof(operation) > addr
+			    && slot < addr + len) {
+				dcache_invalidate(vm, slot, addr, len);
+			}
+		}
+	}
+	if (io_overlaps(vm, addr, len)) {
+		io_written(vm, addr, len);
+	}
+	if (vm->config.profile) {
+		profile_written(vm, addr, len);
+	}
+}
+
+/* the same, for the write made by the operation decoded in d, which is
+ * of at least one byte, as is the case for all but block transfers */
+static inline void mem_written(nevm *vm, const decoded *d) {
+	if (vm->config.trace) {
+		trace_write(d->dst, addr2caddr(d->dst), d->wlen);
+	}
+	if (d->wide) {
+		mem_written_range(vm, d->dst, d->wlen);
+	} else {
+		dcache_invalidate(vm, d->dst & ~(sizeof(operation) - 1),
+				  d->dst, d->wlen);
+		if (vm->config.profile) {
+			profile_written(vm, d->dst, d->wlen);
+		}
+	}
+}
+
+/* whether the operation at ip can be decoded without error, without
+ * growing memory, and compiled */
+static bool can_compile(nevm *vm, uint32_t ip) {
+	operation *op;
+	uint64_t limit;
+	/* with guard pages, arguments out of range fault when used, but
+	 * those past the limit and short of the next page don't */
+	limit = vm->config.guard ? vm->config.brk_max : vm->brk;
+	if (ip < sizeof(operation) || ip % sizeof(operation) != 0
+	    || (uint64_t) ip + sizeof(operation) > vm->brk) {
+		return false;
+	}
+	op = (operation *) addr2caddr(ip);
+	if (!is_op(op->op) || op->op == '@' || op->op == '#'
+	    || !is_arg_type(op->dst_type) || !is_arg_type(op->src1_type)
+	    || !is_arg_type(op->src2_type)) {
+		return false;
+	}
+	if ((is_indirect(op->dst_type)
+	     && (uint64_t) op->dst.u + valsize(op->dst_type) > limit)
+	    || (is_indirect(op->src1_type)
+		&& (uint64_t) op->src1.u + valsize(op->src1_type) > limit)
+	    || (is_indirect(op->src2_type)
+		&& (uint64_t) op->src2.u + valsize(op->src2_type) > limit)) {
+		return false;
+	}
+	switch (op->op) {
+	case '!':
+	case '&':
+	case '|':
+	case '^':
+	case '<':
+	case '>':
+		return op->dst_type != 'F' && op->dst_type != 'f'
+		       && op->dst_type != 'd';
+	default:
+		return true;
+	}
+}
+
+/* mem_written_range(), as called from compiled code */
+static void jit_written(void *vm, uint32_t addr, uint32_t len) {
+	mem_written_range(vm, addr, len);
+}
+
+/* compile the operations starting at start into a block */
+static void jit_compile(nevm *vm, uint32_t start) {
+	struct jit_block *b;
+	decoded *d, *o;
+	operation *op;
+	uint32_t n, i, ip, slot, end;
+	jit_code code;
+
+	if (vm->jit.nblocks == JIT_BLOCKS) {
+		jit_flush(vm);
+	}
+	b = &vm->jit.blocks[vm->jit.nblocks];
+
+	/* find the operations */
+	for (n = 0, ip = start; n < JIT_BLOCK_MAX;
+	     n++, ip += sizeof(operation)) {
+		if (!can_compile(vm, ip)) {
+			break;
+		}
+		d = dcache_entry(ip);
+		if (d->ip != ip) {
+			if (d->ip != DCACHE_EMPTY && d->jit_refs != 0) {
+				jit_kill(vm, d->ip);
+			}
+			decode(vm, ip, d);
+		}
+		/* stop before an operation which rewrites this block, or
+		 * which this block rewrites */
+		if (overlaps_live(d, d->dst, d->wlen)) {
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (overlaps_live(d, b->ops[i].dst, b->ops[i].wlen)
+			    || overlaps_live(&b->ops[i], d->dst, d->wlen)) {
+				break;
+			}
+		}
+		if (i != n) {
+			break;
+		}
+		b->ops[n] = *d;
+		if (d->dst < sizeof(uint32_t)) {
+			/* writes the IP */
+			n++;
+			break;
+		}
+	}
+	if (n == 0) {
+		return;
+	}
+	end = start + n*sizeof(operation);
+
+	/* emit the code */
+	jit_begin(vm->jit.code);
+	for (i = 0; i < n; i++) {
+		o = &b->ops[i];
+		op = (operation *) addr2caddr(o->ip);
+		jit_set_ip(vm->jit.code, o->ip + sizeof(operation));
+		if (!jit_op(vm->jit.code, op->op, op->dst_type,
+			    op->src1_type, op->src2_type,
+			    o->dst, o->src1, o->src2)) {
+			jit_call(vm->jit.code, o);
+		}
+		/* tell anything else which may care about the write */
+		if (io_overlaps(vm, o->dst, o->wlen)) {
+			jit_notify(vm->jit.code, jit_written, vm,
+				   o->dst, o->wlen);
+			continue;
+		}
+		for (slot = o->dst & ~(sizeof(operation) - 1);
+		     slot < o->dst + o->wlen; slot += sizeof(operation)) {
+			if (slot >= sizeof(operation)
+			    && (slot < start || slot >= end)) {
+				jit_check(vm->jit.code,
+					  &dcache_entry(slot)->ip, slot,
+					  jit_written, vm, o->dst, o->wlen);
+			}
+		}
+	}
+	code = jit_end(vm->jit.code, n);
+	if (code == NULL) {
+		/* out of space */
+		jit_flush(vm);
+		return;
+	}
+
+	b->start = start;
+	b->nops = n;
+	b->code = code;
+	vm->jit.nblocks++;
+	vm->stats.jit_blocks++;
+	for (i = 0; i < n; i++) {
+		dcache_entry(start + i*sizeof(operation))->jit_refs++;
+	}
+	dcache_entry(start)->block = b;
+}
+
+/* run compiled code starting at ip, if there is any, returning the IP
+ * afterwards */
+static uint32_t jit_run(nevm *vm, uint32_t ip, uint32_t *countdown) {
+	decoded *d;
+	uint32_t n;
+	for (;;) {
+		d = dcache_entry(ip);
+		if (d->ip != ip || ip % sizeof(operation) != 0) {
+			return ip;
+		}
+		if (d->block == NULL) {
+			if (++d->heat < JIT_THRESHOLD) {
+				return ip;
+			}
+			d->heat = 0;
+			jit_compile(vm, ip);
+			if (d->block == NULL) {
+				return ip;
+			}
+		}
+		if (vm->step_limit != 0 && d->block->nops >= *countdown) {
+			/* it might run past the limit */
+			return ip;
+		}
+		n = d->block->code(vm->mem);
+		vm->stats.jit_ops += n;
+		ip = indirect(0, uint32_t);
+		if (n >= *countdown) {
+			/* poll on the next operation */
+			*countdown = 1;
+			return ip;
+		}
+		*countdown -= n;
+	}
+}
+
+
+/* fused sequences
+ *
+ * A couple of sequences of operations come up again and again: a call,
+ * which saves where to return to and then writes the IP, and a branch,
+ * which makes a mask from a comparison and uses it to choose which of two
+ * operations to write into the slot which follows, before performing it.
+ * When the first operation of one of these is decoded, it is marked as
+ * beginning a fused sequence, and the run loop performs the rest of the
+ * sequence straight after it, rather than going back around for each.
+ * Each of the rest is still performed from its own decode cache entry, so
+ * that rewriting any byte of the sequence which matters drops an entry just
+ * as it would otherwise, and the sequence stops short at the first
+ * operation without one, leaving the run loop to carry on from there.
+ *
+ * The slot a branch writes would miss the cache every time it is reached,
+ * so the last few decodings of it are kept, along with what it held, and
+ * are put back into the cache whenever it holds the same again. */
+
+/* put back the kept decoding of the slot at ip into d, its cache entry, if
+ * there is one for what the slot now holds */
+static bool fused_restore(nevm *vm, decoded *d, uint32_t ip) {
+	struct fused_slot *f;
+	uint32_t i;
+	f = fused_entry(ip);
+	if (f->ip != ip) {
+		return false;
+	}
+	for (i = 0; i < f->nkept; i++) {
+		if (memcmp(&f->held[i], addr2caddr(ip), sizeof(operation))
+		    == 0) {
+			if (d->ip != DCACHE_EMPTY && d->jit_refs != 0) {
+				jit_kill(vm, d->ip);
+			}
+			*d = f->kept[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+/* keep the decoding of the slot at d->ip, which was just made, if it is
+ * one which a fused sequence writes */
+static void fused_keep(nevm *vm, const decoded *d) {
+	struct fused_slot *f;
+	f = fused_entry(d->ip);
+	if (f->ip != d->ip) {
+		return;
+	}
+	memcpy(&f->held[f->next], addr2caddr(d->ip), sizeof(operation));
+	f->kept[f->next] = *d;
+	f->next = (f->next + 1) % FUSED_KEEP;
+	if (f->nkept < FUSED_KEEP) {
+		f->nkept++;
+	}
+}
+
+/* drop every decoded operation, and every kept decoding */
+static void dcache_clear(nevm *vm) {
+	uint32_t i;
+	for (i = 0; i < DCACHE_SIZE; i++) {
+		vm->dcache[i].ip = DCACHE_EMPTY;
+	}
+	for (i = 0; i < FUSED_SLOTS; i++) {
+		vm->fused[i].ip = DCACHE_EMPTY;
+	}
+}
+
+
+/* devices
+ *
+ * A device is a range of memory which the host looks after. The machine's
+ * writes to it are only noted as they happen, and the device is serviced
+ * -- its output taken, and its input given -- in a batch whenever the
+ * machine polls, every config.poll operations, and when it stops. Any write
+ * within the range covering the screen and every device is looked at more
+ * closely by mem_written_range(), so devices are best put near the
+ * screen; writes outside it never look at the devices at all. */
+
+/* note that the host has written len bytes of memory at addr */
+static void host_wrote(nevm *vm, uint32_t addr, uint32_t len) {
+	if (vm->started && vm->config.trace) {
+		trace_write(addr, addr2caddr(addr), len);
+	}
+	mem_written_range(vm, addr, len);
+}
+
+static void host_write(nevm *vm, uint32_t addr, const void *buf,
+		       uint32_t len) {
+	memcpy(addr2caddr(addr), buf, len);
+	host_wrote(vm, addr, len);
+}
+
+static void host_write_word(nevm *vm, uint32_t addr, uint32_t value) {
+	host_write(vm, addr, &value, sizeof(value));
+}
+
+static void service_devices(nevm *vm) {
+	struct device *dev;
+	uint32_t i;
+	for (i = 0; i < vm->io.ndevices; i++) {
+		dev = &vm->io.devices[i];
+		dev->service(vm, dev);
+		dev->written = false;
+	}
+}
+
+static struct device *add_device(nevm *vm, uint32_t addr, uint32_t len) {
+	struct device *dev;
+	uint32_t i;
+	if (vm->io.ndevices == MAX_DEVICES) {
+		fatal("Too many devices\n");
+	}
+	if (len == 0 || check_brk(vm, (uint64_t) addr + len) != 0) {
+		fatal("Could not create memory for device at 0x%x\n", addr);
+	}
+	for (i = 0; i < vm->io.ndevices; i++) {
+		dev = &vm->io.devices[i];
+		if (addr < dev->end && addr + len > dev->start) {
+			fatal("Device at 0x%x overlaps device at 0x%x\n",
+			      addr, dev->start);
+		}
+	}
+	if (vm->started) {
+		/* what has been decoded and compiled doesn't know to look
+		 * for writes to the device */
+		if (vm->jit.enabled) {
+			jit_flush(vm);
+		}
+		dcache_clear(vm);
+	}
+	dev = &vm->io.devices[vm->io.ndevices++];
+	memset(dev, 0, sizeof(*dev));
+	dev->start = addr;
+	dev->end = addr + len;
+	dev->fd = -1;
+	if (dev->start < vm->io.start) {
+		vm->io.start = dev->start;
+	}
+	if (dev->end > vm->io.end) {
+		vm->io.end = dev->end;
+	}
+	return dev;
+}
+
+static void host_service(nevm *vm, struct device *dev) {
+	dev->fn(vm, dev->start, dev->end - dev->start, dev->written,
+		dev->arg);
+}
+
+/* the time since the clock was added */
+static void clock_service(nevm *vm, struct device *dev) {
+	struct timespec now;
+	uint64_t ns;
+	uint32_t t[2];
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = timespec_ns(now) - timespec_ns(dev->base);
+	t[0] = (uint32_t) (ns / 1000000000);
+	t[1] = (uint32_t) (ns % 1000000000);
+	host_write(vm, dev->start, t, sizeof(t));
+}
+
+/* read whatever input is ready into the free part of the ring, without
+ * waiting for more */
+static void input_service(nevm *vm, struct device *dev) {
+	struct pollfd pfd;
+	uint32_t put, taken, size, at, n;
+	ssize_t r;
+	if (dev->fd < 0) {
+		/* the input has ended */
+		return;
+	}
+	size = dev->end - dev->start - NEVM_INPUT_HEADER;
+	put = indirect(dev->start + NEVM_INPUT_PUT, uint32_t);
+	taken = indirect(dev->start + NEVM_INPUT_TAKEN, uint32_t);
+	if (put - taken >= size) {
+		return;
+	}
+	pfd.fd = dev->fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) != 1) {
+		return;
+	}
+	at = put % size;
+	n = size - (put - taken);
+	if (n > size - at) {
+		n = size - at;
+	}
+	r = read(dev->fd, addr2caddr(dev->start + NEVM_INPUT_HEADER + at), n);
+	if (r > 0) {
+		host_wrote(vm, dev->start + NEVM_INPUT_HEADER + at, r);
+		host_write_word(vm, dev->start + NEVM_INPUT_PUT, put + r);
+	} else if (r == 0 || (errno != EINTR && errno != EAGAIN)) {
+		host_write_word(vm, dev->start + NEVM_INPUT_END, 1);
+		dev->fd = -1;
+	}
+}
+
+/* write out whatever the machine has put in the ring, waiting for the
+ * output to take it, or into the file's buffer if it has one */
+static void output_service(nevm *vm, struct device *dev) {
+	uint32_t put, sent, size, at, n;
+	char *p;
+	ssize_t r;
+	size = dev->end - dev->start - NEVM_OUTPUT_HEADER;
+	put = indirect(dev->start + NEVM_OUTPUT_PUT, uint32_t);
+	sent = indirect(dev->start + NEVM_OUTPUT_SENT, uint32_t);
+	if (put == sent) {
+		return;
+	}
+	if (put - sent > size) {
+		/* the machine wrote over what wasn't sent */
+		sent = put - size;
+	}
+	while (sent != put) {
+		at = sent % size;
+		n = put - sent;
+		if (n > size - at) {
+			n = size - at;
+		}
+		p = addr2caddr(dev->start + NEVM_OUTPUT_HEADER + at);
+		r = dev->file != NULL ? (ssize_t) fwrite(p, 1, n, dev->file)
+		    : write(dev->fd, p, n);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			/* try again at the next service */
+			break;
+		}
+		sent += r;
+	}
+	host_write_word(vm, dev->start + NEVM_OUTPUT_SENT, sent);
+}
+
+/* perform the command the machine left, if any */
+static void disk_service(nevm *vm, struct device *dev) {
+	uint32_t words[3];
+	uint32_t command, block, n;
+	char *buf;
+	off_t offset;
+	ssize_t r;
+	int err;
+	if (!dev->written) {
+		return;
+	}
+	command = indirect(dev->start + NEVM_DISK_COMMAND, uint32_t);
+	if (command == 0) {
+		return;
+	}
+	block = indirect(dev->start + NEVM_DISK_NUMBER, uint32_t);
+	buf = addr2caddr(dev->start + NEVM_DISK_HEADER);
+	offset = (off_t) block * NEVM_DISK_BLOCK;
+	r = 0;
+	for (n = 0; n < NEVM_DISK_BLOCK; n += r) {
+		if (command == NEVM_DISK_READ) {
+			r = pread(dev->fd, buf + n, NEVM_DISK_BLOCK - n,
+				  offset + n);
+		} else if (command == NEVM_DISK_WRITE) {
+			r = pwrite(dev->fd, buf + n, NEVM_DISK_BLOCK - n,
+				   offset + n);
+		} else {
+			errno = EINVAL;
+			r = -1;
+		}
+		if (r < 0 && errno == EINTR) {
+			r = 0;
+			continue;
+		}
+		if (r <= 0) {
+			break;
+		}
+	}
+	err = r < 0 ? errno : 0;
+	if (command == NEVM_DISK_WRITE && err == 0 && n < NEVM_DISK_BLOCK) {
+		err = EIO;
+	}
+	if (command == NEVM_DISK_READ && err == 0) {
+		/* past the end of the file reads as zeros */
+		memset(buf + n, 0, NEVM_DISK_BLOCK - n);
+		host_wrote(vm, dev->start + NEVM_DISK_HEADER, NEVM_DISK_BLOCK);
+	}
+	words[0] = 0;
+	words[1] = block;
+	words[2] = (uint32_t) err;
+	host_write(vm, dev->start, words, sizeof(words));
+}
+
+
+/* the VM run loop
+ *
+ * With NEVM_THREADED, each operation jumps directly to the code for the next
+ * using GCC's labels as values, so that every kind of operation has its own
+ * indirect jump for the branch predictor to learn. Otherwise, a switch is
+ * used. Rather than reading the IP back from memory after every operation,
+ * the loop keeps it in a local, and only rereads it when the operation's
+ * destination overlaps the IP. */
+
+/* record the operation about to be performed */
+static void trace_sample(nevm *vm) {
+	static const char invalid[4];
+	uint32_t ip;
+	ip = indirect(0, uint32_t);
+	trace_op(ip, (uint64_t) ip + sizeof(uint32_t) <= vm->brk
+		     ? addr2caddr(ip) : invalid);
+}
+
+/* record the memory the machine starts with, skipping pages of zeros */
+static void trace_start(nevm *vm) {
+	static const char zeros[4096];
+	uint32_t addr, len;
+	for (addr = 0; addr < vm->brk; addr += len) {
+		len = vm->brk - addr < sizeof(zeros)
+		      ? vm->brk - addr : sizeof(zeros);
+		if (memcmp(addr2caddr(addr), zeros, len) != 0) {
+			trace_memory(addr, addr2caddr(addr), len);
+		}
+	}
+}
+
+/* the number of operations run so far */
+static inline uint64_t steps(const nevm *vm) {
+	return (uint64_t) vm->stats.hits + vm->stats.misses
+	       + vm->stats.jit_ops + vm->stats.fused;
+}
+
+/* tell the caller if a frame is due, and delay, if specified. returns the
+ * number of operations until this should next be called, or 0 if the
+ * machine has run as many as it was allowed. */
+static uint32_t poll_frame(nevm *vm) {
+	struct timespec now;
+	uint64_t done, poll;
+	poll = vm->frames.poll;
+	if (vm->step_limit != 0) {
+		done = steps(vm);
+		if (done >= vm->step_limit) {
+			return 0;
+		}
+		if (vm->step_limit - done < poll) {
+			poll = vm->step_limit - done;
+		}
+	}
+	if (vm->config.profile) {
+		profile_sample(vm);
+	}
+	if (vm->config.trace) {
+		trace_sample(vm);
+	}
+	if (vm->io.ndevices != 0) {
+		service_devices(vm);
+	}
+	if (vm->config.frame_fn != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_ge(now, vm->frames.next)) {
+			vm->config.frame_fn(vm, vm->config.frame_arg);
+			vm->frames.next = now;
+			timespec_add(vm->frames.next, vm->config.frame);
+		}
+	}
+	if (vm->frames.delay) {
+		nanosleep(&vm->config.delay, NULL);
+	}
+	return (uint32_t) poll;
+}
+
+/* decode the operation at ip, after a miss in the decode cache, or put
+ * back a kept decoding of it. the first slot holds the IP itself, and
+ * unaligned operations can't be cached */
+static decoded *fetch_miss(nevm *vm, uint32_t ip) {
+	decoded *d;
+	vm->stats.misses++;
+	if (ip % sizeof(operation) != 0 || ip < sizeof(operation)) {
+		d = &vm->uncached;
+	} else {
+		d = dcache_entry(ip);
+		if (fused_restore(vm, d, ip)) {
+			return d;
+		}
+		if (d->ip != DCACHE_EMPTY && d->jit_refs != 0) {
+			jit_kill(vm, d->ip);
+		}
+	}
+	decode(vm, ip, d);
+	fused_keep(vm, d);
+	return d;
+}
+
+/* find the decoded operation at ip. an unaligned ip could match the tag
+ * of an empty entry, so it always misses */
+static inline decoded *fetch(nevm *vm, uint32_t ip) {
+	decoded *d;
+	d = dcache_entry(ip);
+	if (d->ip != ip || ip % sizeof(operation) != 0) {
+		return fetch_miss(vm, ip);
+	}
+	vm->stats.hits++;
+	return d;
+}
+
+/* the bodies of the operations, shared by both kinds of dispatch */
+
+#define run_next() do {							\
+	if (--countdown == 0) {						\
+		countdown = poll_frame(vm);				\
+		if (countdown == 0) {					\
+			run_pause();					\
+			return NEVM_PAUSED;				\
+		}							\
+	}								\
+	d = fetch(vm, ip);						\
+} while (0)
+
+#define run_advance()							\
+	indirect(0, uint32_t) = ip + sizeof(operation)
+
+/* follow a write to the IP, into compiled code if there is any */
+#define run_jump() do {							\
+	ip = indirect(0, uint32_t);					\
+	if (vm->jit.enabled) {						\
+		ip = jit_run(vm, ip, &countdown);			\
+	}								\
+} while (0)
+
+#define run_nop() do {							\
+	run_advance();							\
+	ip += sizeof(operation);					\
+} while (0)
+
+#define run_exec() do {							\
+	run_advance();							\
+	d->exec(vm->mem, d);						\
+	mem_written(vm, d);						\
+	if (d->dst < sizeof(uint32_t)) {				\
+		run_jump();						\
+	} else {							\
+		ip += sizeof(operation);				\
+	}								\
+} while (0)
+
+/* perform an operation which begins a fused sequence, then as much of the
+ * rest of the sequence as can be, as long as that won't run past the next
+ * poll */
+#define run_fused() do {						\
+	run_exec();							\
+	if (countdown <= d->fused) {					\
+		break;							\
+	}								\
+	for (n = d->fused; n != 0; n--) {				\
+		d = dcache_entry(ip);					\
+		if ((d->ip != ip && !fused_restore(vm, d, ip))		\
+		    || d->op == '@' || d->op == '#') {			\
+			break;						\
+		}							\
+		countdown--;						\
+		vm->stats.fused++;					\
+		if (d->op == '_') {					\
+			run_nop();					\
+			continue;					\
+		}							\
+		run_advance();						\
+		d->exec(vm->mem, d);					\
+		mem_written(vm, d);					\
+		if (d->dst < sizeof(uint32_t)) {			\
+			run_jump();					\
+			break;						\
+		}							\
+		ip += sizeof(operation);				\
+	}								\
+} while (0)
+
+#define run_block() do {						\
+	op = (operation *) addr2caddr(ip);				\
+	if (!vm->config.guard || guard_short(vm)) {			\
+		validate_block(vm, op);					\
+	}								\
+	d->wlen = valsize(op->dst_type)					\
+		  * val(op->src2, op->src2_type, uint32_t);		\
+	run_advance();							\
+	d->exec(vm->mem, d);						\
+	if (vm->config.trace) {						\
+		trace_write(d->dst, addr2caddr(d->dst), d->wlen);	\
+	}								\
+	mem_written_range(vm, d->dst, d->wlen);				\
+	if (d->dst < sizeof(uint32_t) && d->wlen != 0) {		\
+		run_jump();						\
+	} else {							\
+		ip += sizeof(operation);				\
+	}								\
+} while (0)
+
+#define run_halt() do {							\
+	run_advance();							\
+	run_pause();							\
+	if (vm->config.trace) {						\
+		trace_halt();						\
+	}								\
+	if (vm->config.frame_fn != NULL) {				\
+		vm->config.frame_fn(vm, vm->config.frame_arg);		\
+	}								\
+} while (0)
+
+#define run_pause() do {						\
+	vm->running = false;						\
+	clock_gettime(CLOCK_MONOTONIC, &vm->stats.end);			\
+	service_devices(vm);						\
+} while (0)
+
+/* set the machine up to run, the first time it is run */
+static void start(nevm *vm) {
+	/* make sure the screen exists in memory */
+	if (check_brk(vm, SCREEN_END) != 0) {
+		fatal("Could not create memory for screen at 0x%x\n",
+		      SCREEN_START);
+	}
+	if (vm->config.guard) {
+		guard_mem(vm);
+	}
+	dcache_clear(vm);
+	vm->frames.delay = vm->config.delay.tv_sec != 0
+			   || vm->config.delay.tv_nsec != 0;
+	/* stepping with a delay gains nothing from compiling, and the
+	 * profiler and tracer need to see every operation */
+	vm->jit.enabled = false;
+	if (vm->config.jit && !vm->frames.delay && !vm->config.profile
+	    && !vm->config.trace) {
+		if (vm->jit.code == NULL) {
+			vm->jit.code = jit_new();
+		}
+		if (vm->jit.blocks == NULL) {
+			vm->jit.blocks = malloc(JIT_BLOCKS
+						* sizeof(struct jit_block));
+		}
+		vm->jit.enabled = vm->jit.code != NULL
+				  && vm->jit.blocks != NULL;
+		vm->jit.nblocks = 0;
+		jit_reset(vm->jit.code);
+	}
+	if (vm->config.profile && vm->profile == NULL) {
+		vm->profile = calloc(1, sizeof(struct profile));
+		if (vm->profile == NULL) {
+			fatal("Could not allocate memory for profile\n");
+		}
+	}
+	/* with no delay, only look at the clock every so often */
+	vm->frames.poll = vm->frames.delay || vm->config.profile
+			  || vm->config.trace ? 1 : vm->config.poll;
+	if (vm->config.trace) {
+		trace_start(vm);
+	}
+	vm->frames.next.tv_sec = 0;
+	vm->frames.next.tv_nsec = 0;
+	clock_gettime(CLOCK_MONOTONIC, &vm->stats.start);
+	vm->started = true;
+}
+
+/* run until the machine halts, or has run max_steps more operations */
+static nevm_stop run(nevm *vm, uint64_t max_steps) {
+	operation *op;
+	decoded *d;
+	uint32_t ip, countdown, n;
+#ifdef NEVM_THREADED
+	static const void *const targets[256] = {
+		[FUSED_OP] = &&op_fused,
+		['_'] = &&op_nop,
+		['='] = &&op_assign,
+		['@'] = &&op_block,
+		['!'] = &&op_not,
+		['&'] = &&op_and,
+		['|'] = &&op_or,
+		['^'] = &&op_xor,
+		['<'] = &&op_shl,
+		['>'] = &&op_shr,
+		['~'] = &&op_neg,
+		['+'] = &&op_add,
+		['-'] = &&op_sub,
+		['*'] = &&op_mul,
+		['/'] = &&op_div,
+		['%'] = &&op_rem,
+		['#'] = &&op_halt
+	};
+	vm->dispatch = targets;
+#endif
+
+	if (!vm->started) {
+		start(vm);
+	}
+	vm->step_limit = max_steps != 0 ? steps(vm) + max_steps : 0;
+	countdown = 1;
+	vm->running = true;
+	running_vm = vm;
+
+	/* read the IP */
+	ip = indirect(0, uint32_t);
+
+#ifdef NEVM_THREADED
+#define op_label(label, body)						\
+	label:								\
+		body;							\
+		run_next();						\
+		goto *d->target
+
+	run_next();
+	goto *d->target;
+
+	op_label(op_nop, run_nop());
+	op_label(op_assign, run_exec());
+	op_label(op_block, run_block());
+	op_label(op_not, run_exec());
+	op_label(op_and, run_exec());
+	op_label(op_or, run_exec());
+	op_label(op_xor, run_exec());
+	op_label(op_shl, run_exec());
+	op_label(op_shr, run_exec());
+	op_label(op_neg, run_exec());
+	op_label(op_add, run_exec());
+	op_label(op_sub, run_exec());
+	op_label(op_mul, run_exec());
+	op_label(op_div, run_exec());
+	op_label(op_rem, run_exec());
+	op_label(op_fused, run_fused());
+op_halt:
+	run_halt();
+	return NEVM_HALTED;
+#else
+	for (;;) {
+		run_next();
+		switch (d->op) {
+		case '_':
+			run_nop();
+			break;
+		case '@':
+			run_block();
+			break;
+		case '#':
+			run_halt();
+			return NEVM_HALTED;
+		default:
+			if (d->fused != 0) {
+				run_fused();
+			} else {
+				run_exec();
+			}
+			break;
+		}
+	}
+#endif
+}
+
+/* count the bytes of memory actually in use */
+static size_t resident_mem(nevm *vm) {
+	unsigned char *vec;
+	size_t page, pages, i, n;
+	if (vm->committed == 0) {
+		return 0;
+	}
+	page = sysconf(_SC_PAGESIZE);
+	pages = vm->committed / page;
+	vec = malloc(pages);
+	if (vec == NULL || mincore(vm->mem, vm->committed, vec) != 0) {
+		free(vec);
+		return 0;
+	}
+	for (i = 0, n = 0; i < pages; i++) {
+		n += vec[i] & 1;
+	}
+	free(vec);
+	return n * page;
+}
+
+/* count the pages of memory in use which are still shared with the file
+ * they were mapped from, and so with every other machine which mapped it,
+ * and the pages which are the machine's own, from the kernel's map of the
+ * process's pages. a page swapped out is counted as the machine's own. */
+static int count_pages(nevm *vm, size_t *shared, size_t *owned) {
+	uint64_t entries[PAGEMAP_CHUNK];
+	size_t page, pages, i, j, n;
+	ssize_t r;
+	off_t offset;
+	int fd, err;
+	*shared = 0;
+	*owned = 0;
+	if (vm->committed == 0) {
+		return 0;
+	}
+	fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	page = sysconf(_SC_PAGESIZE);
+	pages = vm->committed / page;
+	offset = (off_t) ((uintptr_t) vm->mem / page * sizeof(uint64_t));
+	for (i = 0; i < pages; i += n) {
+		n = pages - i < PAGEMAP_CHUNK ? pages - i : PAGEMAP_CHUNK;
+		r = pread(fd, entries, n * sizeof(uint64_t),
+			  offset + i * sizeof(uint64_t));
+		if (r <= 0) {
+			err = r == 0 ? EIO : errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+		n = r / sizeof(uint64_t);
+		for (j = 0; j < n; j++) {
+			if (entries[j] & PAGEMAP_SWAPPED) {
+				(*owned)++;
+			} else if (entries[j] & PAGEMAP_PRESENT) {
+				if (entries[j] & PAGEMAP_FILE) {
+					(*shared)++;
+				} else {
+					(*owned)++;
+				}
+			}
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+/* a slot in the profile, as sorted for writing */
+struct profile_entry {
+	uint32_t addr;
+	struct profile_slot *slot;
+};
+
+static int profile_cmp(const void *a, const void *b) {
+	const struct profile_entry *ea, *eb;
+	ea = a;
+	eb = b;
+	if (ea->slot->ns != eb->slot->ns) {
+		return ea->slot->ns < eb->slot->ns ? 1 : -1;
+	}
+	if (ea->slot->count != eb->slot->count) {
+		return ea->slot->count < eb->slot->count ? 1 : -1;
+	}
+	return ea->addr < eb->addr ? -1 : 1;
+}
+
+/* write the profile, busiest slots first */
+static void write_profile(nevm *vm, FILE *out) {
+	struct profile_entry *entries, *newentries;
+	size_t n, size, i, j;
+	struct profile_slot *p;
+	unsigned long total_count;
+	uint64_t total_ns;
+	char where[256];
+
+	if (vm->profile == NULL) {
+		fatal("The machine wasn't profiled\n");
+	}
+	profile_charge(vm, vm->stats.end);
+	vm->profile->running = false;
+	/* find the slots which ran or were rewritten */
+	n = 0;
+	size = 0;
+	entries = NULL;
+	total_count = 0;
+	total_ns = 0;
+	for (i = 0; i < sizeof(vm->profile->chunks)
+			/ sizeof(vm->profile->chunks[0]); i++) {
+		if (vm->profile->chunks[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < PROFILE_CHUNK_SLOTS; j++) {
+			p = &vm->profile->chunks[i][j];
+			if (p->count == 0 && p->rewrites == 0) {
+				continue;
+			}
+			if (n == size) {
+				size = size == 0 ? 256 : size * 2;
+				newentries = realloc(entries,
+						     size * sizeof(*entries));
+				if (newentries == NULL) {
+					free(entries);
+					fatal("Could not allocate memory"
+					      " for profile\n");
+				}
+				entries = newentries;
+			}
+			entries[n].addr = (uint32_t) ((i << PROFILE_CHUNK_BITS)
+						      + j * sizeof(operation));
+			entries[n++].slot = p;
+			total_count += p->count;
+			total_ns += p->ns;
+		}
+	}
+	qsort(entries, n, sizeof(*entries), profile_cmp);
+
+	fprintf(out, "# %lu operations in %.3f seconds\n",
+		total_count, (double) total_ns / 1e9);
+	fprintf(out, "#%-9s %12s %7s %14s %7s %10s  %s\n",
+		"address", "count", "count%", "time (ns)", "time%",
+		"rewrites", "location");
+	for (i = 0; i < n; i++) {
+		p = entries[i].slot;
+		if (!symbols_describe(entries[i].addr, where, sizeof(where))) {
+			where[0] = '\0';
+		}
+		fprintf(out,
+			"0x%08x %12lu %7.2f %14" PRIu64 " %7.2f %10lu  %s\n",
+			entries[i].addr, p->count,
+			total_count ? 100.0 * p->count / total_count : 0,
+			p->ns, total_ns ? 100.0 * p->ns / total_ns : 0,
+			p->rewrites, where);
+	}
+	free(entries);
+}
+
+
+/* file loading */
+
+#define FILE_CHUNK 4096
+
+/* whether the len bytes at p are all zero */
+static bool all_zero(const char *p, size_t len) {
+	while (len > 0) {
+		if (*p++ != 0) {
+			return false;
+		}
+		len--;
+	}
+	return true;
+}
+
+/* map the file open on fd, which has size bytes, into memory at start,
+ * which is on a page boundary. the file is mapped privately, so that
+ * writes to it don't reach the file, and every machine mapping it shares
+ * its pages until it writes to them. the part of the last page past the
+ * end of the file is mapped too if nothing has been put there, since the
+ * kernel fills it with zeros; otherwise the end of the file is read in,
+ * so that nothing past the end of the file is touched. */
+static int map_file(nevm *vm, int fd, uint32_t start, size_t size) {
+	size_t page, mapped;
+	ssize_t r;
+	page = sysconf(_SC_PAGESIZE);
+	mapped = size / page * page;
+	if (mapped < size && start + mapped + page <= vm->committed
+	    && all_zero(addr2caddr(start + size), mapped + page - size)) {
+		mapped += page;
+	}
+	if (mapped != 0
+	    && mmap(addr2caddr(start), mapped, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		return -1;
+	}
+	while (mapped < size) {
+		r = pread(fd, addr2caddr(start + mapped), size - mapped,
+			  mapped);
+		if (r <= 0) {
+			if (r == 0) {
+				errno = EIO;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		mapped += r;
+	}
+	return 0;
+}
+
+static void load_file(nevm *vm, uint32_t *mem_cursor,
+		      const char *filename) {
+	FILE *f;
+	struct stat st;
+	size_t r;
+	uint32_t start;
+	int err;
+	start = *mem_cursor;
+	if (strcmp(filename, "-") == 0) {
+		f = stdin;
+	} else {
+		f = fopen(filename, "r");
+	}
+	if (f == NULL) {
+		fatal("Couldn't open file \"%s\": %s\n",
+		      filename, strerror(errno));
+	}
+	if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode)
+	    && start % sysconf(_SC_PAGESIZE) == 0) {
+		/* map it straight in */
+		if (check_brk(vm, (uint64_t) start + st.st_size) != 0) {
+			fclose(f);
+			fatal("Could not create memory for file \"%s\" at %"
+			      PRIu64 "\n", filename,
+			      (uint64_t) start + st.st_size);
+		}
+		if (map_file(vm, fileno(f), start, st.st_size) != 0) {
+			err = errno;
+			fclose(f);
+			fatal("Couldn't read from file \"%s\": %s\n",
+			      filename, strerror(err));
+		}
+		fclose(f);
+		*mem_cursor += st.st_size;
+		return;
+	}
+	/* read it a chunk at a time, for pipes and unaligned locations */
+	for (;;) {
+		if (check_brk(vm, (uint64_t) *mem_cursor + FILE_CHUNK) != 0) {
+			if (f != stdin) {
+				fclose(f);
+			}
+			fatal("Could not create memory for file \"%s\" at %"
+			      PRIu64 "\n", filename,
+			      (uint64_t) *mem_cursor + FILE_CHUNK);
+		}
+		r = fread(addr2caddr(*mem_cursor), 1, FILE_CHUNK, f);
+		*mem_cursor += r;
+		if (r != FILE_CHUNK) {
+			if (feof(f)) {
+				if (f != stdin) {
+					fclose(f);
+				}
+				return;
+			} else if (ferror(f)) {
+				err = errno;
+				if (f != stdin) {
+					fclose(f);
+				}
+				fatal("Couldn't read from file \"%s\": %s\n",
+				      filename, strerror(err));
+			}
+		}
+	}
+}
+
+
+/* the machine's public face */
+
+void nevm_config_default(nevm_config *config) {
+	memset(config, 0, sizeof(*config));
+	config->brk_max = 0xFFFF;
+	config->frame.tv_sec = 0;
+	config->frame.tv_nsec = 1000000000 / FRAME_DEFAULT_RATE;
+	config->jit = true;
+	config->poll = DEFAULT_POLL;
+}
+
+nevm *nevm_new(const nevm_config *config) {
+	nevm *vm;
+	vm = calloc(1, sizeof(nevm));
+	if (vm == NULL) {
+		return NULL;
+	}
+	vm->config = *config;
+	if (vm->config.poll == 0) {
+		vm->config.poll = 1;
+	}
+	vm->dirty = SCREEN_ALL_ROWS;
+	vm->io.start = SCREEN_START;
+	vm->io.end = SCREEN_END;
+	return vm;
+}
+
+void nevm_free(nevm *vm) {
+	size_t i;
+	if (vm == NULL) {
+		return;
+	}
+	guard_release(vm);
+	if (vm->mem != NULL) {
+		munmap(vm->mem, vm->reserved);
+	}
+	jit_free(vm->jit.code);
+	free(vm->jit.blocks);
+	if (vm->profile != NULL) {
+		for (i = 0; i < sizeof(vm->profile->chunks)
+				/ sizeof(vm->profile->chunks[0]); i++) {
+			free(vm->profile->chunks[i]);
+		}
+		free(vm->profile);
+	}
+	free(vm);
+}
+
+const char *nevm_error(const nevm *vm) {
+	return vm->error;
+}
+
+int nevm_restore_snapshot(nevm *vm, const char *filename) {
+	enter(vm);
+	restore_snapshot(vm, filename);
+	leave(vm);
+	return 0;
+}
+
+int nevm_load_file(nevm *vm, uint32_t *cursor, const char *filename) {
+	enter(vm);
+	load_file(vm, cursor, filename);
+	leave(vm);
+	return 0;
+}
+
+int nevm_write(nevm *vm, uint32_t addr, const void *buf, uint32_t len) {
+	enter(vm);
+	if (check_brk(vm, (uint64_t) addr + len) != 0) {
+		fatal("Could not create memory for write at %" PRIu64 "\n",
+		      (uint64_t) addr + len);
+	}
+	host_write(vm, addr, buf, len);
+	leave(vm);
+	return 0;
+}
+
+int nevm_add_device(nevm *vm, uint32_t addr, uint32_t len,
+		    nevm_device_fn fn, void *arg) {
+	struct device *dev;
+	enter(vm);
+	dev = add_device(vm, addr, len);
+	dev->service = host_service;
+	dev->fn = fn;
+	dev->arg = arg;
+	leave(vm);
+	return 0;
+}
+
+int nevm_add_clock(nevm *vm, uint32_t addr) {
+	struct device *dev;
+	enter(vm);
+	dev = add_device(vm, addr, NEVM_CLOCK_LEN);
+	dev->service = clock_service;
+	clock_gettime(CLOCK_MONOTONIC, &dev->base);
+	leave(vm);
+	return 0;
+}
+
+int nevm_add_input(nevm *vm, uint32_t addr, uint32_t len, int fd) {
+	struct device *dev;
+	enter(vm);
+	if (len <= NEVM_INPUT_HEADER) {
+		fatal("Input at 0x%x has no room for a buffer\n", addr);
+	}
+	dev = add_device(vm, addr, len);
+	dev->service = input_service;
+	dev->fd = fd;
+	leave(vm);
+	return 0;
+}
+
+int nevm_add_output(nevm *vm, uint32_t addr, uint32_t len, int fd) {
+	struct device *dev;
+	enter(vm);
+	if (len <= NEVM_OUTPUT_HEADER) {
+		fatal("Output at 0x%x has no room for a buffer\n", addr);
+	}
+	dev = add_device(vm, addr, len);
+	dev->service = output_service;
+	dev->fd = fd;
+	leave(vm);
+	return 0;
+}
+
+int nevm_add_output_file(nevm *vm, uint32_t addr, uint32_t len, FILE *f) {
+	struct device *dev;
+	enter(vm);
+	if (len <= NEVM_OUTPUT_HEADER) {
+		fatal("Output at 0x%x has no room for a buffer\n", addr);
+	}
+	dev = add_device(vm, addr, len);
+	dev->service = output_service;
+	dev->file = f;
+	leave(vm);
+	return 0;
+}
+
+int nevm_add_disk(nevm *vm, uint32_t addr, int fd) {
+	struct device *dev;
+	enter(vm);
+	dev = add_device(vm, addr, NEVM_DISK_LEN);
+	dev->service = disk_service;
+	dev->fd = fd;
+	leave(vm);
+	return 0;
+}
+
+int nevm_read(nevm *vm, uint32_t addr, void *buf, uint32_t len) {
+	enter(vm);
+	if ((uint64_t) addr + len > vm->brk) {
+		fatal("Could not read %u bytes at 0x%x, past the break at"
+		      " 0x%x\n", len, addr, vm->brk);
+	}
+	memcpy(buf, addr2caddr(addr), len);
+	leave(vm);
+	return 0;
+}
+
+nevm_stop nevm_run(nevm *vm, uint64_t max_steps) {
+	nevm_stop stop;
+	enter(vm);
+	stop = run(vm, max_steps);
+	running_vm = NULL;
+	leave(vm);
+	return stop;
+}
+
+uint64_t nevm_steps(const nevm *vm) {
+	return steps(vm);
+}
+
+int nevm_write_snapshot(nevm *vm, const char *filename) {
+	enter(vm);
+	write_snapshot(vm, filename);
+	leave(vm);
+	return 0;
+}
+
+int nevm_write_profile(nevm *vm, FILE *out) {
+	enter(vm);
+	write_profile(vm, out);
+	leave(vm);
+	return 0;
+}
+
+void nevm_print_stats(nevm *vm, FILE *out) {
+	unsigned long ops;
+	size_t shared, owned;
+	double secs;
+	ops = steps(vm);
+	secs = (double) (vm->stats.end.tv_sec - vm->stats.start.tv_sec)
+	       + (double) (vm->stats.end.tv_nsec - vm->stats.start.tv_nsec)
+		 / 1e9;
+	fprintf(out, "Ran %lu operations in %.3f seconds"
+		" (%.0f operations per second)\n",
+		ops, secs, secs > 0 ? ops / secs : 0);
+	fprintf(out, "Decode cache: %lu hits, %lu misses,"
+		" %lu invalidations\n",
+		vm->stats.hits, vm->stats.misses, vm->stats.invalidations);
+	fprintf(out, "Fused sequences: %lu operations performed along with"
+		" the one before\n", vm->stats.fused);
+	fprintf(out, "Memory: %zu bytes resident, %zu accessible,"
+		" %zu reserved, break at 0x%x\n",
+		resident_mem(vm), vm->committed, vm->reserved, vm->brk);
+	if (count_pages(vm, &shared, &owned) == 0) {
+		fprintf(out, "Pages: %zu shared with loaded files,"
+			" %zu private\n", shared, owned);
+	}
+	if (vm->jit.enabled) {
+		fprintf(out, "Native code: %lu operations, %lu blocks"
+			" compiled, %lu discarded\n",
+			vm->stats.jit_ops, vm->stats.jit_blocks,
+			vm->stats.jit_discarded);
+	}
+}
+
+int nevm_count_pages(nevm *vm, size_t *shared, size_t *owned) {
+	enter(vm);
+	if (count_pages(vm, shared, owned) != 0) {
+		fatal("Couldn't read the page map: %s\n", strerror(errno));
+	}
+	leave(vm);
+	return 0;
+}
+
+char *nevm_mem(nevm *vm) {
+	return vm->mem;
+}
+
+uint32_t nevm_brk(const nevm *vm) {
+	return vm->brk;
+}
+
+uint32_t nevm_take_dirty(nevm *vm) {
+	uint32_t dirty;
+	dirty = vm->dirty;
+	vm->dirty = 0;
+	return dirty;
+}
+
+const nevm_stats *nevm_get_stats(const nevm *vm) {
+	return &vm->stats;
+}
+
+void nevm_print_screen(const char *screen, FILE *out) {
+	int i, rows;
+	for (rows = SCREEN_ROWS; rows > 0; rows--) {
+		if (screen[(rows - 1)*SCREEN_COLS] != '\0') {
+			break;
+		}
+	}
+	for (i = 0; i < rows; i++) {
+		fprintf(out, "%.*s\n", SCREEN_COLS, screen + i*SCREEN_COLS);
+	}
+}
+
+bool nevm_is_op(char op) {
+	return is_op(op);
+}
+
+bool nevm_is_arg_type(char type) {
+	return is_arg_type(type);
+}
+
+int nevm_load_map(const char *filename, uint32_t base, uint32_t len) {
+	return symbols_load(filename, base, len);
+}
+
+int nevm_trace_open(const char *filename) {
+	return trace_open(filename);
+}
+
+int nevm_trace_close(void) {
+	return trace_close();
+}